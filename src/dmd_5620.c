@@ -56,22 +56,96 @@
 
 #include "version.h"
 #include "dmd_5620.h"
+#include "profile.h"
+#include "shm_export.h"
+#include "metrics.h"
+#include "screen_text.h"
+#include "trace.h"
+#include "pointer.h"
+#include "heatmap.h"
+#include "tuning.h"
+#include "tee.h"
 
 #ifndef MIN
 #define MIN(a,b)    ((a) <= (b) ? (a) : (b))
 #endif
 
 #define PCHAR(p)   (((p) >= 0x20 && (p) < 0x7f) ? (p) : '.')
-#define TX_BUF_LEN    64
-#define MAX_STEPS     350000
+#define HIDDEN_POLL_MS 16
+#define HEADLESS_POLL_MS 16
+
+/* Frame ring. FRAME_NEW is set in ready_frame while it holds a
+ * frame that draw_handler has not picked up yet. */
+#define FRAME_COUNT   3
+#define FRAME_NEW     0x4
+#define FRAME_INDEX   0x3
+
+/* Boot timing, in emulated seconds. The firmware is considered ready
+ * once the screen has been drawn and then left unchanged for
+ * READY_STABLE_SEC. */
+#define READY_STABLE_SEC     0.5
+#define FAST_BOOT_MAX_SEC    10.0
+#define FAST_BOOT_BUDGET_US  12000
+
+/* Low-latency input. A burst is BURST_SEC of emulated time, and bursts
+ * may run at most one 60 Hz frame ahead of real time. Host output is
+ * watched for INPUT_WINDOW_US after each input event. */
+#define BURST_SEC            0.002
+#define BURST_MAX_DEBT_SEC   (1.0 / 60)
+#define INPUT_WINDOW_US      100000
+
+/* Glyph learning: ticks to let the screen settle after calibration */
+#define LEARN_SETTLE_TICKS   60
+
+/* Performance dialog: readout refresh, and the Save button's response */
+#define PERF_READOUT_MS      500
+#define PERF_RESPONSE_SAVE   1
+
+/* Long options without a short equivalent */
+enum {
+    OPT_PROFILE_RATE = 256,
+    OPT_PROFILE_MAP,
+    OPT_PROFILE_FORMAT,
+    OPT_GLYPHS,
+    OPT_LEARN_GLYPHS,
+    OPT_TEXT_CELL,
+    OPT_WAIT_TEXT,
+    OPT_DUMP_TEXT,
+    OPT_TIMEOUT,
+    OPT_HOST_POINTER,
+    OPT_HEATMAP_LOG,
+    OPT_CONFIG,
+    OPT_TEE
+};
 
 char VERSION_STRING[64];
 GtkWidget *main_window;
-cairo_surface_t *surface = NULL;
-GdkPixbuf *pixbuf = NULL;
-int pty_master, pty_slave;
+/*
+ * Triple-buffered frames, all allocated once when the window is
+ * first configured.
+ * refresh_display converts into the back frame and publishes it by
+ * exchanging it with ready_frame. draw_handler exchanges its front
+ * frame for the ready one before painting, so it always paints the
+ * latest complete frame and never one that is being written.
+ */
+cairo_surface_t *frames[FRAME_COUNT];
+int back_frame = 0;
+int ready_frame = 1;
+int front_frame = 2;
+
+/*
+ * Frames are only updated on rows that changed. shadow_vram holds the
+ * video RAM of the last converted frame, and frame_rows has one bit
+ * per row that each frame still needs converted.
+ */
+uint8_t shadow_vram[VIDRAM_SIZE];
+uint8_t frame_rows[FRAME_COUNT][HEIGHT / 8];
+uint32_t expand_table[256][8];
+int palette = -1;
+int pty_master = -1, pty_slave = -1;
 char *nvram = NULL;
 size_t previous_clock = 0;
+gint64 last_refresh = 0;
 struct pollfd fds[2];
 pid_t shell_pid;
 volatile bool window_beep = true;
@@ -79,6 +153,89 @@ int sigint_count = 0;
 int tty_fd = -1;
 bool debug = false;
 
+/* The last read from the host, handed straight to the DUART */
+uint8_t rx_buf[TUNING_BUF_MAX];
+
+/* Rows written by the CPU since the last conversion */
+uint8_t vram_written[HEIGHT / 8];
+
+/* The core's video RAM dirty flag clears when it is read, so it is
+ * latched here separately for the display and for check_ready */
+bool frame_dirty = false;
+bool ready_dirty = true;
+bool headless = false;
+GMainLoop *main_loop = NULL;
+int exit_status = 0;
+
+/* Window visibility. While the display can't be seen, VRAM is not
+ * converted and no draws are queued, but emulation keeps running. */
+bool window_mapped = false;
+bool window_iconified = false;
+bool window_obscured = false;
+bool display_visible = false;
+bool display_stale = false;
+guint hidden_timer = 0;
+
+/* Startup tracking, for --fast-boot and the time-to-ready report */
+bool fast_boot = false;
+bool booting = true;
+gint64 start_time = 0;
+size_t boot_steps = 0;
+size_t stable_steps = 0;
+uint32_t ready_hash = 0;
+bool ready_blank = true;
+
+/* Low-latency input state. burst_debt counts steps run early by input
+ * bursts, which are taken out of the following ticks, so the overall
+ * rate never exceeds the normal cycle budget. */
+bool low_latency = false;
+size_t burst_debt = 0;
+gint64 input_time = 0;
+gint64 input_window_end = 0;
+guint input_watch = 0;
+GtkWidget *burst_widget = NULL;
+
+/* Screen text scripting. The calibration text shows every printable
+ * character once, from the top left of a cleared screen. */
+char *learn_glyphs = NULL;
+char *wait_text = NULL;
+char *dump_text = NULL;
+gint64 timeout_us = 0;
+
+/* Config file holding the performance settings, and the widgets of
+ * the Performance dialog while it is open */
+char *config_path = NULL;
+
+struct performance_dialog
+{
+    GtkWidget *dialog;
+    GtkWidget *cpu_mhz;
+    GtkWidget *max_steps;
+    GtkWidget *buf_len;
+    GtkWidget *tty_poll_ms;
+    GtkWidget *frame_cap;
+    GtkWidget *render_mode;
+    GtkWidget *readout;
+    guint timer;
+    gint64 last_time;
+    uint64_t last_steps;
+    uint64_t last_ticks;
+    uint64_t last_tick_us;
+    uint64_t last_frames;
+};
+
+struct performance_dialog perf_dialog;
+
+/* Trace file written at exit, if any. SIGUSR1 always dumps the trace. */
+char *trace_file = NULL;
+size_t learn_sent = 0;
+int learn_settle = 0;
+const char *LEARN_CLEAR = "\033[H\033[J";
+const char *LEARN_LINES[] = {
+    "!\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNO",
+    "PQRSTUVWXYZ[\\]^_`abcdefghijklmnopqrstuvwxyz{|}~"
+};
+
 void
 int_handler(int signal)
 {
@@ -87,196 +244,1072 @@ int_handler(int signal)
         exit(1);
     }
 
-    if (main_window != NULL) {
-        gtk_window_close(GTK_WINDOW(main_window));
-    }
+    if (main_window != NULL) {
+        gtk_window_close(GTK_WINDOW(main_window));
+    }
+
+    sigint_count++;
+}
+
+void
+close_window()
+{
+    uint8_t buf[NVRAM_SIZE];
+    FILE *fp;
+
+    if (nvram != NULL && dmd_get_nvram(buf) == 0) {
+        fp = fopen(nvram, "w+");
+        if (fp == NULL) {
+            fprintf(stderr, "Could not open %s for writing. Skipping\n", nvram);
+        } else {
+            if (fwrite(buf, NVRAM_SIZE, 1, fp) != 1) {
+                fprintf(stderr, "Could not write full NVRAM file %s\n", nvram);
+            } else {
+                METRIC_ADD(nvram_metrics.flushes, 1);
+            }
+        }
+    }
+
+    profile_write();
+    shm_export_close();
+    pointer_close();
+    heatmap_close();
+    tee_close();
+
+    if (trace_file != NULL && trace_dump() < 0) {
+        fprintf(stderr, "Could not write trace file %s\n", trace_file);
+    }
+    metrics_close();
+
+    if (dump_text != NULL) {
+        write_screen_text(dump_text);
+    }
+
+    if (headless) {
+        fprintf(stderr, "Serial: %lu bytes received (%lu dropped), %lu bytes sent\n",
+                (unsigned long) METRIC_GET(serial_metrics.rx_bytes),
+                (unsigned long) METRIC_GET(serial_metrics.rx_dropped),
+                (unsigned long) METRIC_GET(serial_metrics.tx_bytes));
+    }
+
+    frame_ring_destroy();
+
+    if (headless) {
+        g_main_loop_quit(main_loop);
+    } else {
+        gtk_main_quit();
+    }
+}
+
+gboolean
+configure_handler(GtkWidget *widget, GdkEventConfigure *event, gpointer data)
+{
+    /* The window is not resizable, so the frames only need to be
+     * created once, as soon as there is a window to match. */
+    if (frames[0] == NULL) {
+        frame_ring_init(gtk_widget_get_window(widget));
+    }
+
+    return TRUE;
+}
+
+/*
+ * Frames are image surfaces in the window's preferred format, so
+ * that painting one is a plain blit. Without a window (headless),
+ * ordinary image surfaces are used.
+ */
+void
+frame_ring_init(GdkWindow *window)
+{
+    for (int i = 0; i < FRAME_COUNT; i++) {
+        if (window != NULL) {
+            frames[i] = gdk_window_create_similar_image_surface(window,
+                                                                CAIRO_FORMAT_RGB24,
+                                                                WIDTH, HEIGHT, 1);
+        } else {
+            frames[i] = cairo_image_surface_create(CAIRO_FORMAT_RGB24, WIDTH, HEIGHT);
+        }
+        /* Every row must be converted into every frame at least once */
+        memset(frame_rows[i], 0xff, sizeof(frame_rows[i]));
+    }
+
+    palette = -1;
+}
+
+void
+frame_ring_destroy()
+{
+    for (int i = 0; i < FRAME_COUNT; i++) {
+        if (frames[i] != NULL) {
+            cairo_surface_destroy(frames[i]);
+            frames[i] = NULL;
+        }
+    }
+}
+
+/*
+ * Producer side: hand the completed back frame over, and take the
+ * previously ready frame (which nobody is reading) as the new back.
+ */
+void
+frame_publish()
+{
+    int old = __atomic_exchange_n(&ready_frame, back_frame | FRAME_NEW,
+                                  __ATOMIC_ACQ_REL);
+    back_frame = old & FRAME_INDEX;
+}
+
+/*
+ * Consumer side: return the most recently completed frame.
+ */
+cairo_surface_t *
+frame_latest()
+{
+    if (__atomic_load_n(&ready_frame, __ATOMIC_ACQUIRE) & FRAME_NEW) {
+        int old = __atomic_exchange_n(&ready_frame, front_frame,
+                                      __ATOMIC_ACQ_REL);
+        front_frame = old & FRAME_INDEX;
+    }
+
+    return frames[front_frame];
+}
+
+gboolean
+draw_handler(GtkWidget *widget, cairo_t *cr, gpointer data)
+{
+    /* GTK has already clipped the context to the damaged region */
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(cr, frame_latest(), 0, 0);
+    cairo_paint(cr);
+    heatmap_draw(cr);
+    return FALSE;
+}
+
+/*
+ * Compare the written rows of video RAM against the shadow copy of
+ * the last converted frame, and mark changed rows as pending in every
+ * frame of the ring. The written rows are cleared. Returns the number
+ * of rows that changed, and their extent.
+ */
+int
+diff_rows(const uint8_t *vram, uint8_t *written, int *first, int *last)
+{
+    int changed = 0;
+
+    *first = HEIGHT;
+    *last = -1;
+
+    for (int y = 0; y < HEIGHT; y++) {
+        size_t offset = y * WIDTH_IN_BYTES;
+
+        if (!(written[y / 8] & (1 << (y % 8)))) {
+            continue;
+        }
+
+        if (memcmp(shadow_vram + offset, vram + offset, WIDTH_IN_BYTES) == 0) {
+            continue;
+        }
+
+        memcpy(shadow_vram + offset, vram + offset, WIDTH_IN_BYTES);
+
+        for (int i = 0; i < FRAME_COUNT; i++) {
+            frame_rows[i][y / 8] |= 1 << (y % 8);
+        }
+
+        if (screen_text_enabled) {
+            screen_text_mark_row(y);
+        }
+
+        if (y < *first) {
+            *first = y;
+        }
+        *last = y;
+        changed++;
+    }
+
+    memset(written, 0, HEIGHT / 8);
+
+    return changed;
+}
+
+/*
+ * Read the core's video RAM dirty flag, and latch it for each of the
+ * places that want to know about writes.
+ */
+void
+latch_video_dirty()
+{
+    if (dmd_video_ram_dirty()) {
+        frame_dirty = true;
+        ready_dirty = true;
+    }
+}
+
+/*
+ * Mark rows as possibly written since the last call, and return
+ * whether any were. The core only says whether anything at all was
+ * written, so every row is marked and diff_rows finds the real ones.
+ */
+bool
+video_rows_written(uint8_t *rows)
+{
+    latch_video_dirty();
+
+    if (!frame_dirty) {
+        return false;
+    }
+
+    frame_dirty = false;
+
+    memset(rows, 0xff, HEIGHT / 8);
+
+    return true;
+}
+
+/*
+ * Build the table that expands one byte of video RAM into eight
+ * pixels in the current foreground and background colours.
+ */
+void
+build_expand_table(const struct color *fg, const struct color *bg)
+{
+    uint32_t fg_pixel = (fg->r << 16) | (fg->g << 8) | fg->b;
+    uint32_t bg_pixel = (bg->r << 16) | (bg->g << 8) | bg->b;
+
+    for (int b = 0; b < 256; b++) {
+        for (int i = 0; i < 8; i++) {
+            expand_table[b][i] = ((b >> (7 - i)) & 1) ? fg_pixel : bg_pixel;
+        }
+    }
+}
+
+gboolean
+refresh_display(GtkWidget *widget, gpointer data)
+{
+    uint8_t oport;
+    uint8_t *vram;
+    uint8_t *rows;
+    bool dirty;
+    unsigned char *pixel_data;
+    int stride, first, last;
+    uint32_t converted = 0;
+    bool full = false;
+    GdkWindow *window;
+
+    /* Draw the frame */
+    if (window_beep && widget != NULL) {
+        window = gtk_widget_get_window(widget);
+        gdk_window_beep(window);
+        window_beep = false;
+    }
+
+    dirty = video_rows_written(vram_written);
+
+    /* Shared memory consumers see every frame, visible or not */
+    if (shm_exporting) {
+        dmd_get_duart_output_port(&oport);
+        shm_export_publish(dirty ? dmd_video_ram() : NULL, oport);
+    }
+
+    /* If the window can't be seen, skip the conversion entirely,
+     * but remember that the screen changed so that a single catch-up
+     * frame is produced once it becomes visible again. */
+    if (!display_visible) {
+        if (dirty) {
+            display_stale = true;
+            METRIC_ADD(video_metrics.frames_skipped, 1);
+        }
+        return TRUE;
+    }
+
+    /* If the video RAM hasn't been updated, there's nothing to do */
+    if (!dirty && !display_stale) {
+        return TRUE;
+    }
+
+    /* Rows written while the screen could not be shown, or replaced
+     * wholesale, are not all known */
+    if (display_stale) {
+        memset(vram_written, 0xff, sizeof(vram_written));
+    }
+
+    display_stale = false;
+
+    if (frames[0] == NULL) {
+        return TRUE;
+    }
+
+    vram = dmd_video_ram();
+
+    if (vram == NULL) {
+        fprintf(stderr, "ERROR: Unable to access video ram!\n");
+        exit(-1);
+    }
+
+    /* Bit 2 of the DUART output port controls whether the
+     * screen is Dark-on-Light or Light-on-Dark
+     */
+    dmd_get_duart_output_port(&oport);
+
+    if ((oport & 0x2) != palette) {
+        palette = oport & 0x2;
+        if (palette) {
+            build_expand_table(&COLOR_DARK, &COLOR_LIGHT);
+        } else {
+            build_expand_table(&COLOR_LIGHT, &COLOR_DARK);
+        }
+        full = true;
+    }
+
+    if (full || tuning.render_mode == RENDER_FULL) {
+        for (int i = 0; i < FRAME_COUNT; i++) {
+            memset(frame_rows[i], 0xff, sizeof(frame_rows[i]));
+        }
+        memset(vram_written, 0xff, sizeof(vram_written));
+        diff_rows(vram, vram_written, &first, &last);
+        first = 0;
+        last = HEIGHT - 1;
+    } else if (diff_rows(vram, vram_written, &first, &last) == 0) {
+        /* Written, but to identical contents */
+        return TRUE;
+    }
+
+    /* Convert every row this frame has not yet seen */
+    rows = frame_rows[back_frame];
+
+    cairo_surface_flush(frames[back_frame]);
+    pixel_data = cairo_image_surface_get_data(frames[back_frame]);
+    stride = cairo_image_surface_get_stride(frames[back_frame]);
+
+    for (int y = 0; y < HEIGHT; y++) {
+        uint32_t *pixel;
+        const uint8_t *src;
+
+        if (!(rows[y / 8] & (1 << (y % 8)))) {
+            continue;
+        }
+
+        pixel = (uint32_t *)(pixel_data + y * stride);
+        src = shadow_vram + y * WIDTH_IN_BYTES;
+        METRIC_ADD(video_metrics.rows_converted, 1);
+        converted++;
+
+        for (int x = 0; x < WIDTH_IN_BYTES; x++) {
+            memcpy(pixel, expand_table[src[x]], sizeof(expand_table[0]));
+            pixel += 8;
+        }
+    }
+
+    memset(rows, 0, sizeof(frame_rows[0]));
+    cairo_surface_mark_dirty(frames[back_frame]);
+    trace(TRACE_VRAM_DIRTY, converted);
+
+    frame_publish();
+    METRIC_ADD(video_metrics.frames_converted, 1);
+
+    /* Time from the first unanswered input event to a changed frame */
+    if (input_time != 0) {
+        gint64 latency = g_get_monotonic_time() - input_time;
+        METRIC_ADD(input_metrics.latency_count, 1);
+        METRIC_ADD(input_metrics.latency_sum_us, latency);
+        input_time = 0;
+    }
+
+    /* Notify the widget that the changed rows should be repainted */
+    if (widget != NULL) {
+        gtk_widget_queue_draw_area(widget, 0, first, WIDTH, last - first + 1);
+    }
+
+    return TRUE;
+}
+
+void
+boot_ready(bool timed_out)
+{
+    gint64 elapsed = g_get_monotonic_time() - start_time;
+
+    booting = false;
+    METRIC_SET(cpu_metrics.ready_us, elapsed);
+
+    if (fast_boot || debug) {
+        printf("Time to ready: %.1f ms (%lu steps%s)\n",
+               elapsed / 1000.0,
+               boot_steps,
+               timed_out ? ", timed out" : "");
+    }
+
+    /* Whatever was drawn during boot must be shown */
+    display_stale = true;
+}
+
+/*
+ * Watch the screen until the firmware settles after its self-test.
+ * The frame is only hashed again when the core reports a write to it.
+ */
+void
+check_ready(size_t steps)
+{
+    uint8_t *vram;
+    uint8_t bits = 0;
+    uint32_t hash = 2166136261u;
+    bool changed;
+
+    vram = dmd_video_ram();
+
+    if (vram == NULL) {
+        return;
+    }
+
+    boot_steps += steps;
+
+    latch_video_dirty();
+
+    if (ready_dirty) {
+        ready_dirty = false;
+
+        /* FNV-1a over the whole frame */
+        for (int i = 0; i < VIDRAM_SIZE; i++) {
+            bits |= vram[i];
+            hash = (hash ^ vram[i]) * 16777619u;
+        }
+
+        changed = bits == 0 || hash != ready_hash;
+        ready_hash = hash;
+        ready_blank = bits == 0;
+    } else {
+        changed = ready_blank;
+    }
+
+    if (changed) {
+        stable_steps = 0;
+    } else {
+        stable_steps += steps;
+    }
+
+    if (stable_steps >= tuning_steps(READY_STABLE_SEC)) {
+        boot_ready(false);
+    } else if (boot_steps >= tuning_steps(FAST_BOOT_MAX_SEC)) {
+        boot_ready(true);
+    }
+}
+
+/*
+ * Run the core for the given number of steps, sampling the guest PC
+ * along the way if profiling is enabled.
+ */
+void
+step_core(size_t steps)
+{
+    if (profiling) {
+        profile_step_loop(steps);
+    } else {
+        dmd_step_loop(steps);
+    }
+
+    METRIC_ADD(cpu_metrics.steps, steps);
+    trace(TRACE_STEPS, (uint32_t) steps);
+}
+
+void
+simulation_step(size_t now)
+{
+    uint8_t kbc;
+    size_t steps;
+
+    /*
+     * Poll for simulator I/O
+     */
+    io_poll();
+
+    /*
+     * Poll for output to the keyboard (i.e. system beep)
+     */
+    if (dmd_keyboard_tx(&kbc) == 0) {
+        if (kbc & 0x08) {
+            /* Beep! For thread safety reasons, we don't
+             * actually interct with GDK in this
+             * thread. Instead, we set a flag telling
+             * refresh_display to beep for us. */
+            window_beep = TRUE;
+        }
+    }
+
+    /*
+     * In fast-boot mode, run the core uncapped for most of each frame
+     * until the firmware is ready, then fall back to normal pacing.
+     */
+    if (fast_boot && booting) {
+        gint64 deadline = g_get_monotonic_time() + FAST_BOOT_BUDGET_US;
+
+        do {
+            step_core(tuning.max_steps);
+            check_ready(tuning.max_steps);
+        } while (booting && g_get_monotonic_time() < deadline);
+
+        previous_clock = now;
+        return;
+    }
+
+    /*
+     * Execute the appropriate number of CPU steps based on frame rate.
+     */
+    if (previous_clock > 0) {
+        /* We take 7.2 simulated steps per microsecond of wall clock
+         * time, based on a 7.2 MHz WE 32100 CPU, unless the clock has
+         * been tuned. The maximum number of steps allowed is limited
+         * in order to prevent the CPU simulation from stealing too
+         * much processing time if running on a system with a slower
+         * main GTK thread refresh rate. */
+        size_t delta = now - previous_clock;
+        steps = MIN((size_t)(tuning.cpu_mhz * delta), tuning.max_steps);
+        if (delta > 0) {
+            METRIC_SET(cpu_metrics.rate_hz, steps * 1000000 / delta);
+        }
+    } else {
+        steps = tuning.max_steps;
+    }
+
+
+    previous_clock = now;
+
+    /* Steps already run early for input are not run again */
+    if (burst_debt > 0) {
+        size_t repaid = MIN(burst_debt, steps);
+        burst_debt -= repaid;
+        steps -= repaid;
+    }
+
+    /* Actually call the core CPU library */
+    step_core(steps);
+
+    if (booting) {
+        check_ready(steps);
+    }
+}
+
+void
+io_poll()
+{
+    if (tty_fd >= 0) {
+        tty_io_poll();
+    } else if (pty_master >= 0) {
+        pty_io_poll();
+    }
+}
+
+/*
+ * Refresh the display, no more often than the frame cap allows.
+ * Changes not shown yet stay marked dirty in the core. Both callers
+ * are timed on the monotonic clock, not the frame clock, whose frame
+ * times can be ahead of it.
+ */
+void
+capped_refresh(GtkWidget *widget)
+{
+    gint64 now = g_get_monotonic_time();
+
+    if (tuning.frame_cap == 0 || now - last_refresh >= (gint64) (1000000 / tuning.frame_cap)) {
+        refresh_display(widget, NULL);
+        last_refresh = now;
+    }
+}
+
+/*
+ * Run a short burst of emulation right away, rather than waiting for
+ * the next tick, and convert the frame if the screen changed and the
+ * frame cap allows. Returns false if the burst budget is used up.
+ */
+bool
+input_burst()
+{
+    size_t steps = tuning_steps(BURST_SEC);
+
+    if (burst_debt + steps > tuning_steps(BURST_MAX_DEBT_SEC)) {
+        return false;
+    }
+
+    io_poll();
+    step_core(steps);
+    io_poll();
+
+    burst_debt += steps;
+    METRIC_ADD(input_metrics.bursts, 1);
+    trace(TRACE_BURST, (uint32_t) steps);
+
+    capped_refresh(burst_widget);
+
+    return true;
+}
+
+/*
+ * Host output arriving shortly after an input event is most likely
+ * its echo, so it gets a burst of its own.
+ */
+gboolean
+input_echo_handler(gint fd, GIOCondition condition, gpointer data)
+{
+    if (g_get_monotonic_time() > input_window_end || !input_burst()) {
+        input_watch = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Note an input event for latency measurement and, with --low-latency,
+ * run a burst for it. Mouse motion doesn't burst: it arrives far too
+ * often, and would spend the whole burst budget.
+ */
+void
+input_event(bool burst)
+{
+    gint64 now = g_get_monotonic_time();
+
+    /* Latency is measured in every mode, for comparison */
+    if (input_time == 0 || now - input_time > INPUT_WINDOW_US) {
+        input_time = now;
+    }
+
+    if (!low_latency || booting || !burst) {
+        return;
+    }
+
+    input_window_end = now + INPUT_WINDOW_US;
+
+    input_burst();
+
+    if (!input_watch && (tty_fd >= 0 || pty_master >= 0)) {
+        input_watch = g_unix_fd_add(tty_fd < 0 ? pty_master : tty_fd,
+                                    G_IO_IN, input_echo_handler, NULL);
+    }
+}
+
+/*
+ * One emulation tick: step the simulation, then refresh the display.
+ * The time it takes is recorded in the tick duration histogram.
+ */
+void
+run_tick(GtkWidget *widget, size_t now)
+{
+    gint64 start = g_get_monotonic_time();
+
+    trace(TRACE_TICK_BEGIN, 0);
+
+    simulation_step(now);
+
+    /* Now refresh the display */
+    capped_refresh(widget);
+
+    if (host_pointer) {
+        pointer_update(dmd_video_ram(), METRIC_GET(cpu_metrics.steps));
+    }
+
+    if (heatmap_enabled) {
+        heatmap_sample(dmd_video_ram(), g_get_monotonic_time());
+        /* The heat decays, so the overlay changes every tick */
+        if (heatmap_visible && widget != NULL) {
+            gtk_widget_queue_draw(widget);
+        }
+    }
+
+    trace(TRACE_TICK_END, 0);
+
+    metrics_tick(g_get_monotonic_time() - start);
+}
+
+gboolean
+simulation_main_loop(GtkWidget *widget, GdkFrameClock *clock, gpointer data)
+{
+    run_tick(widget, gdk_frame_clock_get_frame_time(clock));
+
+    return TRUE;
+}
+
+/*
+ * The frame clock stops ticking when the window is unmapped or
+ * iconified, so while the display is hidden a plain timeout keeps
+ * the simulation and its I/O running.
+ */
+gboolean
+hidden_main_loop(gpointer data)
+{
+    run_tick(GTK_WIDGET(data), g_get_monotonic_time());
+
+    return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Without a window there is no frame clock at all. Signals only bump
+ * sigint_count, and the shutdown happens here, outside the handler.
+ */
+gboolean
+headless_main_loop(gpointer data)
+{
+    if (sigint_count) {
+        close_window();
+        return G_SOURCE_REMOVE;
+    }
+
+    run_tick(NULL, g_get_monotonic_time());
+
+    if (learn_glyphs != NULL) {
+        return learn_step();
+    }
+
+    if (wait_text != NULL) {
+        screen_text_update(shadow_vram);
+        if (screen_text_find(wait_text)) {
+            close_window();
+            return G_SOURCE_REMOVE;
+        }
+    }
+
+    if (timeout_us > 0 && g_get_monotonic_time() - start_time > timeout_us) {
+        if (wait_text != NULL) {
+            fprintf(stderr, "Timed out waiting for \"%s\".\n", wait_text);
+            exit_status = 1;
+        }
+        close_window();
+        return G_SOURCE_REMOVE;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Send a byte string to the terminal as if it came from the host,
+ * a little at a time as the DUART accepts it. Returns true once all
+ * of it has been sent.
+ */
+bool
+inject_host_bytes(const char *bytes, size_t len, size_t *sent)
+{
+    *sent += rs232_rx_buf((const uint8_t *) bytes + *sent, len - *sent);
+
+    return *sent == len;
+}
+
+/*
+ * Glyph learning, run from the headless loop with nothing attached to
+ * the serial line: once the firmware is ready, clear the screen, show
+ * the calibration text, let it settle, and hash what is on screen.
+ */
+gboolean
+learn_step()
+{
+    static GString *calibration = NULL;
+
+    if (booting) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    if (calibration == NULL) {
+        calibration = g_string_new(LEARN_CLEAR);
+        g_string_append(calibration, LEARN_LINES[0]);
+        g_string_append(calibration, "\r\n");
+        g_string_append(calibration, LEARN_LINES[1]);
+    }
+
+    if (!inject_host_bytes(calibration->str, calibration->len, &learn_sent)) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    if (++learn_settle < LEARN_SETTLE_TICKS) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    if (screen_text_learn(shadow_vram, LEARN_LINES, 2, learn_glyphs) < 0) {
+        exit_status = 1;
+    }
+
+    close_window();
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Write the screen as text to "path", or to standard output if it
+ * is "-".
+ */
+void
+write_screen_text(const char *path)
+{
+    char *screen;
+    FILE *fp;
+
+    if (!screen_text_enabled) {
+        return;
+    }
+
+    /* Read every row from video memory, since the last changes may
+     * not have been through a refresh yet */
+    for (int y = 0; y < HEIGHT; y++) {
+        screen_text_mark_row(y);
+    }
+    screen_text_update(dmd_video_ram());
+    screen = screen_text_dump();
+
+    if (strcmp(path, "-") == 0) {
+        fputs(screen, stdout);
+    } else if ((fp = fopen(path, "w")) == NULL) {
+        fprintf(stderr, "Could not open %s for writing screen text.\n", path);
+    } else {
+        fputs(screen, fp);
+        fclose(fp);
+    }
+
+    g_free(screen);
+}
+
+void
+copy_screen_text()
+{
+    char *screen;
+
+    screen_text_update(shadow_vram);
+    screen = screen_text_dump();
+    gtk_clipboard_set_text(gtk_clipboard_get(GDK_SELECTION_CLIPBOARD), screen, -1);
+    g_free(screen);
+}
+
+/*
+ * Apply the Performance dialog's settings as soon as one changes.
+ */
+void
+performance_changed(GtkWidget *widget, gpointer data)
+{
+    GtkSpinButton *cpu_mhz = GTK_SPIN_BUTTON(perf_dialog.cpu_mhz);
+    GtkSpinButton *max_steps = GTK_SPIN_BUTTON(perf_dialog.max_steps);
+    GtkSpinButton *buf_len = GTK_SPIN_BUTTON(perf_dialog.buf_len);
+    GtkSpinButton *tty_poll_ms = GTK_SPIN_BUTTON(perf_dialog.tty_poll_ms);
+    GtkSpinButton *frame_cap = GTK_SPIN_BUTTON(perf_dialog.frame_cap);
+
+    tuning.cpu_mhz = gtk_spin_button_get_value(cpu_mhz);
+    tuning.max_steps = (size_t) gtk_spin_button_get_value_as_int(max_steps);
+    tuning.buf_len = (size_t) gtk_spin_button_get_value_as_int(buf_len);
+    tuning.tty_poll_ms = gtk_spin_button_get_value_as_int(tty_poll_ms);
+    tuning.frame_cap = (unsigned int) gtk_spin_button_get_value_as_int(frame_cap);
+
+    if (gtk_combo_box_get_active(GTK_COMBO_BOX(perf_dialog.render_mode)) == RENDER_FULL) {
+        tuning.render_mode = RENDER_FULL;
+    } else {
+        tuning.render_mode = RENDER_ROWS;
+    }
+
+    tuning_clamp();
+}
+
+/*
+ * Show the effective clock rate and the cost of a frame, averaged
+ * since the last readout.
+ */
+gboolean
+performance_readout(gpointer data)
+{
+    gint64 now = g_get_monotonic_time();
+    uint64_t steps = METRIC_GET(cpu_metrics.steps);
+    uint64_t ticks = METRIC_GET(tick_metrics.count);
+    uint64_t tick_us = METRIC_GET(tick_metrics.sum_us);
+    uint64_t frames = METRIC_GET(video_metrics.frames_converted);
+    char text[128];
+
+    if (perf_dialog.last_time > 0 && now > perf_dialog.last_time) {
+        gint64 elapsed = now - perf_dialog.last_time;
+        uint64_t tick_count = ticks - perf_dialog.last_ticks;
+
+        snprintf(text, sizeof(text),
+                 "Effective clock: %.2f MHz\n"
+                 "Frame cost: %.2f ms\n"
+                 "Frames converted: %.0f per second",
+                 (double)(steps - perf_dialog.last_steps) / elapsed,
+                 tick_count > 0 ? (tick_us - perf_dialog.last_tick_us) / 1000.0 / tick_count : 0.0,
+                 (frames - perf_dialog.last_frames) * 1000000.0 / elapsed);
+        gtk_label_set_text(GTK_LABEL(perf_dialog.readout), text);
+    }
+
+    perf_dialog.last_time = now;
+    perf_dialog.last_steps = steps;
+    perf_dialog.last_ticks = ticks;
+    perf_dialog.last_tick_us = tick_us;
+    perf_dialog.last_frames = frames;
 
-    sigint_count++;
+    return G_SOURCE_CONTINUE;
 }
 
 void
-close_window()
+performance_response(GtkDialog *dialog, gint response, gpointer data)
 {
-    uint8_t buf[NVRAM_SIZE];
-    FILE *fp;
-
-    if (nvram != NULL && dmd_get_nvram(buf) == 0) {
-        fp = fopen(nvram, "w+");
-        if (fp == NULL) {
-            fprintf(stderr, "Could not open %s for writing. Skipping\n", nvram);
-        } else {
-            if (fwrite(buf, NVRAM_SIZE, 1, fp) != 1) {
-                fprintf(stderr, "Could not write full NVRAM file %s\n", nvram);
-            }
+    if (response == PERF_RESPONSE_SAVE) {
+        if (tuning_save(config_path) < 0 && main_window != NULL) {
+            gtk_widget_error_bell(main_window);
         }
+        return;
     }
 
-    if (surface) {
-        cairo_surface_destroy(surface);
-    }
-
-    gtk_main_quit();
+    g_source_remove(perf_dialog.timer);
+    perf_dialog.dialog = NULL;
+    gtk_widget_destroy(GTK_WIDGET(dialog));
 }
 
-gboolean
-configure_handler(GtkWidget *widget, GdkEventConfigure *event, gpointer data)
+/*
+ * Add a labelled spin button to a row of the Performance dialog.
+ */
+GtkWidget *
+performance_spin(GtkWidget *grid, int row, const char *text,
+                 double min, double max, double step, guint digits, double value)
 {
-    if (surface) {
-        cairo_surface_destroy(surface);
-    }
+    GtkWidget *label = gtk_label_new(text);
+    GtkWidget *spin = gtk_spin_button_new_with_range(min, max, step);
 
-    surface = gdk_window_create_similar_surface(gtk_widget_get_window(widget),
-                                                CAIRO_CONTENT_COLOR,
-                                                gtk_widget_get_allocated_width(widget),
-                                                gtk_widget_get_allocated_height(widget));
+    gtk_spin_button_set_digits(GTK_SPIN_BUTTON(spin), digits);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin), value);
+    gtk_widget_set_halign(label, GTK_ALIGN_START);
 
-    pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, WIDTH, HEIGHT);
+    gtk_grid_attach(GTK_GRID(grid), label, 0, row, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), spin, 1, row, 1, 1);
 
-    return TRUE;
-}
+    g_signal_connect(spin, "value-changed", G_CALLBACK(performance_changed), NULL);
 
-gboolean
-draw_handler(GtkWidget *widget, cairo_t *cr, gpointer data)
-{
-    cairo_set_source_surface(cr, surface, 0, 0);
-    gdk_cairo_set_source_pixbuf(cr, pixbuf, 0, 0);
-    cairo_paint(cr);
-    return FALSE;
+    return spin;
 }
 
-gboolean
-refresh_display(GtkWidget *widget, gpointer data)
+/*
+ * Settings > Performance: change the emulator's performance settings
+ * while it runs.
+ */
+void
+show_performance()
 {
-    uint8_t oport;
-    uint8_t *vram;
-    guchar *pixel_data;
-    uint32_t pixel_data_index;
-    GdkWindow *window;
-    const struct color *fg_color;
-    const struct color *bg_color;
-
-    /* Draw the frame */
-    window = gtk_widget_get_window(widget);
-
-    if (window_beep) {
-        gdk_window_beep(window);
-        window_beep = false;
-    }
+    GtkWidget *dialog;
+    GtkWidget *grid;
+    GtkWidget *label;
+    GtkWidget *content_area;
+    GtkDialogFlags flags = GTK_DIALOG_DESTROY_WITH_PARENT;
 
-    /* If the video RAM hasn't been updated, there's nothing to do */
-    if (!dmd_video_ram_dirty()) {
-        return TRUE;
+    if (perf_dialog.dialog != NULL) {
+        gtk_window_present(GTK_WINDOW(perf_dialog.dialog));
+        return;
     }
 
-    vram = dmd_video_ram();
+    dialog = gtk_dialog_new_with_buttons("Performance",
+                                         GTK_WINDOW(main_window),
+                                         flags,
+                                         "Save",
+                                         PERF_RESPONSE_SAVE,
+                                         "Close",
+                                         GTK_RESPONSE_CLOSE,
+                                         NULL);
 
-    pixel_data = gdk_pixbuf_get_pixels(pixbuf);
-    pixel_data_index = 0;
+    content_area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
 
-    if (vram == NULL) {
-        fprintf(stderr, "ERROR: Unable to access video ram!\n");
-        exit(-1);
-    } else {
-        /* Bit 2 of the DUART output port controls whether the
-         * screen is Dark-on-Light or Light-on-Dark
-         */
-        dmd_get_duart_output_port(&oport);
+    gtk_widget_set_margin_start(content_area, 20);
+    gtk_widget_set_margin_end(content_area, 20);
+    gtk_widget_set_margin_top(content_area, 20);
+    gtk_widget_set_margin_bottom(content_area, 20);
 
-        if (oport & 0x2) {
-            fg_color = &COLOR_DARK;
-            bg_color = &COLOR_LIGHT;
-        } else {
-            fg_color = &COLOR_LIGHT;
-            bg_color = &COLOR_DARK;
-        }
-
-        for (int y = 0; y < HEIGHT; y++) {
-            for (int x = 0; x < WIDTH_IN_BYTES; x++) {
-                uint8_t b = vram[y*WIDTH_IN_BYTES + x];
-                for (int i = 0; i < 8; i++) {
-                    int bit = (b >> (7 - i)) & 1;
-                    if (bit) {
-                        pixel_data[pixel_data_index++] = fg_color->r;
-                        pixel_data[pixel_data_index++] = fg_color->g;
-                        pixel_data[pixel_data_index++] = fg_color->b;
-                        pixel_data[pixel_data_index++] = fg_color->a;
-                    } else {
-                        pixel_data[pixel_data_index++] = bg_color->r;
-                        pixel_data[pixel_data_index++] = bg_color->g;
-                        pixel_data[pixel_data_index++] = bg_color->b;
-                        pixel_data[pixel_data_index++] = bg_color->a;
-                    }
-                }
-            }
-        }
-    }
+    grid = gtk_grid_new();
+    gtk_grid_set_row_spacing(GTK_GRID(grid), 8);
+    gtk_grid_set_column_spacing(GTK_GRID(grid), 12);
+
+    perf_dialog.dialog = dialog;
+    perf_dialog.cpu_mhz = performance_spin(grid, 0, "CPU clock (MHz)",
+                                           0.1, 1000, 0.1, 2, tuning.cpu_mhz);
+    perf_dialog.max_steps = performance_spin(grid, 1, "Maximum steps per frame",
+                                             1000, 100000000, 10000, 0, tuning.max_steps);
+    perf_dialog.buf_len = performance_spin(grid, 2, "Serial buffer (bytes)",
+                                           1, TUNING_BUF_MAX, 16, 0, tuning.buf_len);
+    perf_dialog.tty_poll_ms = performance_spin(grid, 3, "Serial device poll timeout (ms)",
+                                               0, 1000, 1, 0, tuning.tty_poll_ms);
+    perf_dialog.frame_cap = performance_spin(grid, 4, "Frame cap (0 for none)",
+                                             0, 1000, 1, 0, tuning.frame_cap);
+
+    label = gtk_label_new("Render mode");
+    gtk_widget_set_halign(label, GTK_ALIGN_START);
+    perf_dialog.render_mode = gtk_combo_box_text_new();
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(perf_dialog.render_mode), "Changed rows");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(perf_dialog.render_mode), "Full frame");
+    gtk_combo_box_set_active(GTK_COMBO_BOX(perf_dialog.render_mode), tuning.render_mode);
+    gtk_grid_attach(GTK_GRID(grid), label, 0, 5, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), perf_dialog.render_mode, 1, 5, 1, 1);
+    g_signal_connect(perf_dialog.render_mode, "changed", G_CALLBACK(performance_changed), NULL);
+
+    perf_dialog.readout = gtk_label_new("");
+    gtk_widget_set_halign(perf_dialog.readout, GTK_ALIGN_START);
+    gtk_grid_attach(GTK_GRID(grid), perf_dialog.readout, 0, 6, 2, 1);
+
+    perf_dialog.last_time = 0;
+    performance_readout(NULL);
+    perf_dialog.timer = g_timeout_add(PERF_READOUT_MS, performance_readout, NULL);
+
+    g_signal_connect(dialog, "response", G_CALLBACK(performance_response), NULL);
+
+    gtk_container_add(GTK_CONTAINER(content_area), grid);
+    gtk_widget_show_all(dialog);
+}
 
-    /* Notify the widget that it should repaint itself */
-    gtk_widget_queue_draw(widget);
+void
+toggle_heatmap(GtkCheckMenuItem *item, gpointer data)
+{
+    heatmap_show(gtk_check_menu_item_get_active(item));
 
-    return TRUE;
+    /* Draw or remove the overlay right away */
+    gtk_widget_queue_draw(main_window);
 }
 
-gboolean
-simulation_main_loop(GtkWidget *widget, GdkFrameClock *clock, gpointer data)
+void
+update_visibility(GtkWidget *widget)
 {
-    uint8_t kbc;
-    size_t now, steps;
-
-    /*
-     * Poll for simulator I/O
-     */
-    if (tty_fd < 0) {
-        pty_io_poll();
-    } else {
-        tty_io_poll();
+    bool visible = window_mapped && !window_iconified && !window_obscured;
+
+    /* The frame clock only stops for an unmapped or iconified window.
+     * An obscured one keeps ticking and just skips conversion, so the
+     * timer must not run alongside it. */
+    if (!window_mapped || window_iconified) {
+        if (!hidden_timer) {
+            hidden_timer = g_timeout_add(HIDDEN_POLL_MS, hidden_main_loop, widget);
+        }
+    } else if (hidden_timer) {
+        g_source_remove(hidden_timer);
+        hidden_timer = 0;
     }
 
-    /*
-     * Poll for output to the keyboard (i.e. system beep)
-     */
-    if (dmd_keyboard_tx(&kbc) == 0) {
-        if (kbc & 0x08) {
-            /* Beep! For thread safety reasons, we don't
-             * actually interct with GDK in this
-             * thread. Instead, we set a flag telling
-             * refresh_display to beep for us. */
-            window_beep = TRUE;
-        }
+    if (visible == display_visible) {
+        return;
     }
 
-    /*
-     * Execute the appropriate number of CPU steps based on frame rate.
-     */
-    now = gdk_frame_clock_get_frame_time(clock);
+    display_visible = visible;
 
-    if (previous_clock > 0) {
-        /* We take 7.2 simulated steps per microsecond of wall clock
-         * time, based on a 7.2 MHz WE 32100 CPU. The maximum number of
-         * steps allowed is limited in order to prevent the CPU
-         * simulation from stealing too much processing time if
-         * running on a system with a slower main GTK thread refresh
-         * rate. */
-        size_t delta = now - previous_clock;
-        steps = MIN((size_t)(7.2 * delta), MAX_STEPS);
-        if (debug) {
-            printf("[MAIN LOOP] executing %lu steps in %lu us. rate ~= %.2f MHz\n",
-                   steps,
-                   delta,
-                   (float)steps / (float)delta);
-        }
-    } else {
-        steps = MAX_STEPS;
+    if (visible) {
+        /* Produce one catch-up frame on the next refresh */
+        display_stale = true;
+        gtk_widget_queue_draw(widget);
     }
+}
 
+gboolean
+map_handler(GtkWidget *widget, GdkEvent *event, gpointer data)
+{
+    window_mapped = (event->type == GDK_MAP);
+    update_visibility(widget);
+    return FALSE;
+}
 
-    previous_clock = now;
-
-    /* Actually call the core CPU library */
-    dmd_step_loop(steps);
+gboolean
+visibility_handler(GtkWidget *widget, GdkEventVisibility *event, gpointer data)
+{
+    window_obscured = (event->state == GDK_VISIBILITY_FULLY_OBSCURED);
+    update_visibility(widget);
+    return FALSE;
+}
 
-    /* Now refresh the display */
-    return refresh_display(widget, data);
+gboolean
+window_state_handler(GtkWidget *widget, GdkEventWindowState *event, gpointer data)
+{
+    window_iconified = (event->new_window_state &
+                        (GDK_WINDOW_STATE_ICONIFIED | GDK_WINDOW_STATE_WITHDRAWN)) != 0;
+    update_visibility(GTK_WIDGET(data));
+    return FALSE;
 }
 
 gboolean
@@ -284,6 +1317,13 @@ mouse_moved(GtkWidget *widget, GdkEventMotion *event, gpointer data)
 {
     dmd_mouse_move((uint16_t) event->x, (uint16_t) (1024 - event->y));
 
+    if (host_pointer) {
+        pointer_moved((int) event->x, (int) event->y);
+    }
+    METRIC_ADD(input_metrics.mouse_events, 1);
+    trace(TRACE_MOUSE, 0);
+    input_event(false);
+
     return TRUE;
 }
 
@@ -295,6 +1335,9 @@ mouse_button(GtkWidget *widget, GdkEventButton *event, gpointer data)
        here. */
     uint8_t button = event->button - 1;
 
+    METRIC_ADD(input_metrics.mouse_events, 1);
+    trace(TRACE_MOUSE, event->button);
+
     switch(event->type) {
     case GDK_BUTTON_PRESS:
         dmd_mouse_down(button);
@@ -306,6 +1349,8 @@ mouse_button(GtkWidget *widget, GdkEventButton *event, gpointer data)
         break;
     }
 
+    input_event(true);
+
     return TRUE;
 }
 
@@ -370,38 +1415,146 @@ pty_init(const char *shell, char *envp[])
     close(pty_slave);
 }
 
+/*
+ * Hand bytes to the DUART, up to the first one the core does not
+ * take. Returns how many were taken.
+ */
+size_t
+rs232_rx_buf(const uint8_t *buf, size_t len)
+{
+    size_t n = 0;
+
+    while (n < len && dmd_rs232_rx(buf[n]) == 0) {
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * Collect up to len bytes transmitted by the DUART into buf, and
+ * return how many there were.
+ */
+size_t
+rs232_tx_buf(uint8_t *buf, size_t len)
+{
+    size_t n = 0;
+
+    while (n < len && dmd_rs232_tx(&buf[n]) == 0) {
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * Account for a fresh read of len bytes into rx_buf, and deliver it.
+ * The core only refuses a byte if it cannot be reached at all, and
+ * anything after that is dropped.
+ */
+void
+rx_received(size_t len)
+{
+    size_t taken;
+
+    METRIC_ADD(serial_metrics.rx_bytes, len);
+    trace(TRACE_RX_BATCH, (uint32_t) len);
+
+    if (teeing) {
+        tee_record(TEE_FROM_HOST, rx_buf, len);
+    }
+
+    taken = rs232_rx_buf(rx_buf, len);
+
+    if (taken < len) {
+        METRIC_ADD(serial_metrics.rx_dropped, len - taken);
+    }
+}
+
+/*
+ * Send everything the DUART has transmitted to the host, a buffer at
+ * a time.
+ */
+void
+tx_flush(int fd)
+{
+    uint8_t buf[TUNING_BUF_MAX];
+    uint32_t total = 0;
+    size_t len;
+
+    while ((len = rs232_tx_buf(buf, tuning.buf_len)) > 0) {
+        size_t written = 0;
+
+        while (written < len) {
+            ssize_t n = write(fd, buf + written, len - written);
+
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                fprintf(stderr, "Error %d from write: %s\n", errno, strerror(errno));
+                break;
+            }
+
+            written += n;
+        }
+
+        METRIC_ADD(serial_metrics.tx_bytes, written);
+        total += written;
+
+        if (teeing) {
+            tee_record(TEE_TO_HOST, buf, written);
+        }
+    }
+
+    if (total > 0) {
+        trace(TRACE_TX_BATCH, total);
+    }
+}
+
+/*
+ * The shell has exited, which the PTY can report before SIGCHLD
+ * arrives. Stop polling it, and shut down the same way as on SIGCHLD,
+ * so that close_window still writes the profile, trace and text dump.
+ */
+void
+shell_exited()
+{
+    close(pty_master);
+    pty_master = -1;
+
+    if (sigint_count == 0) {
+        int_handler(SIGCHLD);
+    }
+}
+
 /*
  * PTY implemntation of read and write polling
  */
 void
 pty_io_poll()
 {
-    uint8_t txc;
-    char tx_buf[TX_BUF_LEN];
-    int b_read, i;
+    int b_read;
 
     if (poll(fds, 2, 0) > 0) {
-        if (fds[0].revents & POLLIN) {
-            b_read = read(pty_master, tx_buf, TX_BUF_LEN);
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            b_read = read(pty_master, rx_buf, tuning.buf_len);
 
-            if (b_read <= 0) {
-                perror("Nothing to read from child: ");
-                exit(-1);
+            if (b_read == 0 || (b_read < 0 && errno == EIO)) {
+                shell_exited();
+                return;
             }
 
-            for (i = 0; i < b_read; i++) {
-                dmd_rs232_rx(tx_buf[i] & 0xff);
+            if (b_read < 0) {
+                perror("Nothing to read from child: ");
+                exit(-1);
             }
-        }
-    }
 
-    i = 0;
-    while (dmd_rs232_tx(&txc) == 0) {
-        if (write(pty_master, &txc, 1) < 0) {
-            fprintf(stderr, "Error %d from write: %s\n", errno, strerror(errno));
+            rx_received(b_read);
         }
     }
 
+    tx_flush(pty_master);
 }
 
 /*
@@ -452,27 +1605,20 @@ tty_init(int fd)
 void
 tty_io_poll()
 {
-    uint8_t txc;
-    char tx_buf[TX_BUF_LEN];
-    int b_read, i;
+    int b_read;
 
-    if (poll(fds, 2, 100) > 0) {
+    if (poll(fds, 2, tuning.tty_poll_ms) > 0) {
         if (fds[0].revents & POLLIN) {
 
-            b_read = read(tty_fd, tx_buf, TX_BUF_LEN);
+            b_read = read(tty_fd, rx_buf, tuning.buf_len);
 
-            for (i = 0; i < b_read; i++) {
-                dmd_rs232_rx(tx_buf[i] & 0xff);
+            if (b_read > 0) {
+                rx_received(b_read);
             }
         }
     }
 
-    i = 0;
-    while (dmd_rs232_tx(&txc) == 0) {
-        if (write(tty_fd, &txc, 1) < 0) {
-            fprintf(stderr, "error %d during write: %s\n", errno, strerror(errno));
-        }
-    }
+    tx_flush(tty_fd);
 }
 
 gboolean
@@ -662,6 +1808,9 @@ keydown(GtkWidget *widget, GdkEventKey *event, gpointer data)
     }
 
     dmd_keyboard_rx(c);
+    METRIC_ADD(input_metrics.keyboard_events, 1);
+    trace(TRACE_KEY, c);
+    input_event(true);
 
     return TRUE;
 }
@@ -703,35 +1852,77 @@ void
 build_menu(GtkWidget *menu_bar)
 {
     GtkWidget *file_menu;
+    GtkWidget *edit_menu;
+    GtkWidget *view_menu;
+    GtkWidget *settings_menu;
     GtkWidget *help_menu;
 
     GtkWidget *file_mi;
     GtkWidget *quit_mi;
 
+    GtkWidget *edit_mi;
+    GtkWidget *copy_mi;
+
+    GtkWidget *view_mi;
+    GtkWidget *heatmap_mi;
+
+    GtkWidget *settings_mi;
+    GtkWidget *performance_mi;
+
     GtkWidget *help_mi;
     GtkWidget *about_mi;
 
 
     file_menu = gtk_menu_new();
+    edit_menu = gtk_menu_new();
+    view_menu = gtk_menu_new();
+    settings_menu = gtk_menu_new();
     help_menu = gtk_menu_new();
 
     file_mi = gtk_menu_item_new_with_label("File");
     quit_mi = gtk_menu_item_new_with_label("Quit");
 
+    edit_mi = gtk_menu_item_new_with_label("Edit");
+    copy_mi = gtk_menu_item_new_with_label("Copy");
+
+    view_mi = gtk_menu_item_new_with_label("View");
+    heatmap_mi = gtk_check_menu_item_new_with_label("Write Heatmap");
+
+    settings_mi = gtk_menu_item_new_with_label("Settings");
+    performance_mi = gtk_menu_item_new_with_label("Performance...");
+
     help_mi = gtk_menu_item_new_with_label("Help");
     about_mi = gtk_menu_item_new_with_label("About");
 
     gtk_menu_item_set_submenu(GTK_MENU_ITEM(file_mi), file_menu);
     gtk_menu_shell_append(GTK_MENU_SHELL(file_menu), quit_mi);
 
+    gtk_menu_item_set_submenu(GTK_MENU_ITEM(edit_mi), edit_menu);
+    gtk_menu_shell_append(GTK_MENU_SHELL(edit_menu), copy_mi);
+
+    gtk_menu_item_set_submenu(GTK_MENU_ITEM(view_mi), view_menu);
+    gtk_menu_shell_append(GTK_MENU_SHELL(view_menu), heatmap_mi);
+
+    gtk_menu_item_set_submenu(GTK_MENU_ITEM(settings_mi), settings_menu);
+    gtk_menu_shell_append(GTK_MENU_SHELL(settings_menu), performance_mi);
+
     gtk_menu_item_set_submenu(GTK_MENU_ITEM(help_mi), help_menu);
     gtk_menu_shell_append(GTK_MENU_SHELL(help_menu), about_mi);
 
     gtk_menu_shell_append(GTK_MENU_SHELL(menu_bar), file_mi);
+    gtk_menu_shell_append(GTK_MENU_SHELL(menu_bar), edit_mi);
+    gtk_menu_shell_append(GTK_MENU_SHELL(menu_bar), view_mi);
+    gtk_menu_shell_append(GTK_MENU_SHELL(menu_bar), settings_mi);
     gtk_menu_shell_append(GTK_MENU_SHELL(menu_bar), help_mi);
 
+    /* Copying the screen as text needs a glyph table (--glyphs) */
+    gtk_widget_set_sensitive(copy_mi, screen_text_enabled);
+
     /* Exit when user selects "Quit" from menu */
     g_signal_connect(quit_mi, "activate", G_CALLBACK(close_window), NULL);
+    g_signal_connect(copy_mi, "activate", G_CALLBACK(copy_screen_text), NULL);
+    g_signal_connect(heatmap_mi, "toggled", G_CALLBACK(toggle_heatmap), NULL);
+    g_signal_connect(performance_mi, "activate", G_CALLBACK(show_performance), NULL);
     g_signal_connect(about_mi, "activate", G_CALLBACK(show_about), NULL);
 }
 
@@ -774,6 +1965,13 @@ gtk_setup(int *argc, char ***argv)
     gtk_widget_set_size_request(drawing_area, 800, 1024);
     gtk_box_pack_end(GTK_BOX(box), drawing_area, FALSE, FALSE, 0);
 
+    /* Input bursts refresh the display directly */
+    burst_widget = drawing_area;
+
+    if (host_pointer) {
+        pointer_init(drawing_area);
+    }
+
     gtk_container_add(GTK_CONTAINER(main_window), box);
 
     /* Set up the animation handler, which will step the simulation
@@ -786,6 +1984,16 @@ gtk_setup(int *argc, char ***argv)
     g_signal_connect(drawing_area, "configure-event",
                      G_CALLBACK(configure_handler), NULL);
 
+    /* Visibility tracking, so hidden windows don't burn time rendering */
+    g_signal_connect(drawing_area, "map-event",
+                     G_CALLBACK(map_handler), NULL);
+    g_signal_connect(drawing_area, "unmap-event",
+                     G_CALLBACK(map_handler), NULL);
+    g_signal_connect(drawing_area, "visibility-notify-event",
+                     G_CALLBACK(visibility_handler), NULL);
+    g_signal_connect(main_window, "window-state-event",
+                     G_CALLBACK(window_state_handler), drawing_area);
+
     /* UI signals */
     g_signal_connect(drawing_area, "button-press-event",
                      G_CALLBACK(mouse_button), NULL);
@@ -801,7 +2009,9 @@ gtk_setup(int *argc, char ***argv)
                           | GDK_BUTTON_PRESS_MASK
                           | GDK_BUTTON_RELEASE_MASK
                           | GDK_KEY_PRESS_MASK
-                          | GDK_POINTER_MOTION_MASK);
+                          | GDK_POINTER_MOTION_MASK
+                          | GDK_STRUCTURE_MASK
+                          | GDK_VISIBILITY_NOTIFY_MASK);
 
     gtk_widget_show_all(main_window);
     gtk_window_present(GTK_WINDOW(main_window));
@@ -815,13 +2025,35 @@ struct option long_options[] = {
     {"shell", required_argument, 0, 's'},
     {"device", required_argument, 0, 'd'},
     {"nvram", required_argument, 0, 'n'},
+    {"fast-boot", no_argument, 0, 'F'},
+    {"profile-guest", required_argument, 0, 'P'},
+    {"shm", required_argument, 0, 'S'},
+    {"headless", no_argument, 0, 'H'},
+    {"metrics", required_argument, 0, 'm'},
+    {"low-latency", no_argument, 0, 'L'},
+    {"trace", required_argument, 0, 'T'},
+    {"glyphs", required_argument, 0, OPT_GLYPHS},
+    {"learn-glyphs", required_argument, 0, OPT_LEARN_GLYPHS},
+    {"text-cell", required_argument, 0, OPT_TEXT_CELL},
+    {"wait-text", required_argument, 0, OPT_WAIT_TEXT},
+    {"dump-text", required_argument, 0, OPT_DUMP_TEXT},
+    {"timeout", required_argument, 0, OPT_TIMEOUT},
+    {"host-pointer", no_argument, 0, OPT_HOST_POINTER},
+    {"heatmap-log", required_argument, 0, OPT_HEATMAP_LOG},
+    {"config", required_argument, 0, OPT_CONFIG},
+    {"tee", required_argument, 0, OPT_TEE},
+    {"profile-rate", required_argument, 0, OPT_PROFILE_RATE},
+    {"profile-map", required_argument, 0, OPT_PROFILE_MAP},
+    {"profile-format", required_argument, 0, OPT_PROFILE_FORMAT},
     {"debug", no_argument, 0, 'b'}, /* Hidden and undocumented */
     {0, 0, 0, 0}};
 
 void usage()
 {
     printf("Usage: dmd5620 [-h] [-v] [-i] [-d DEV|-s SHELL] \\\n"
-           "               [-f VER] [-n FILE] [-- <gtk_options> ...]\n");
+           "               [-f VER] [-n FILE] [-F] [-H] [-P FILE] [-S NAME] \\\n"
+           "               [-m PATH] [-L] [-T FILE] \\\n"
+           "               [-- <gtk_options> ...]\n");
     printf("AT&T DMD 5620 Terminal emulator.\n\n");
     printf("-h, --help              display help and exit\n");
     printf("-v, --version           display version and exit\n");
@@ -830,6 +2062,29 @@ void usage()
     printf("-d, --device DEV        serial port name\n");
     printf("-s, --shell SHELL       execute SHELL instead of default user shell\n");
     printf("-n, --nvram FILE        store nvram state in FILE\n");
+    printf("-F, --fast-boot         run the firmware self-test at full speed\n");
+    printf("-P, --profile-guest FILE\n");
+    printf("                        sample the guest PC and write a profile to FILE\n");
+    printf("    --profile-rate HZ   samples per emulated second (default %d)\n",
+           PROFILE_DEFAULT_RATE);
+    printf("    --profile-map FILE  resolve addresses using symbol map FILE\n");
+    printf("    --profile-format FMT\n");
+    printf("                        \"folded\" (default) or \"flat\"\n");
+    printf("-S, --shm NAME          publish the screen in shared memory NAME\n");
+    printf("-H, --headless          run without opening a window\n");
+    printf("-m, --metrics PATH      serve Prometheus metrics on Unix socket PATH\n");
+    printf("-L, --low-latency       run the CPU immediately on key and mouse button input\n");
+    printf("-T, --trace FILE        write the event trace to FILE on exit\n");
+    printf("    --glyphs FILE       recognize screen text using glyph table FILE\n");
+    printf("    --learn-glyphs FILE learn the firmware font into glyph table FILE\n");
+    printf("    --text-cell WxH+X+Y character cell geometry used for learning\n");
+    printf("    --wait-text TEXT    with --headless, exit once TEXT is on screen\n");
+    printf("    --dump-text FILE    write the screen as text to FILE on exit\n");
+    printf("    --timeout SECONDS   with --headless, exit after SECONDS\n");
+    printf("    --host-pointer      draw the pointer on the host, shaped like the guest's\n");
+    printf("    --heatmap-log FILE  log screen writes per second to FILE as CSV\n");
+    printf("    --config FILE       read performance settings from FILE\n");
+    printf("    --tee FILE          log all serial traffic to FILE\n");
 }
 
 const char *FIRMWARE_873 = "8;7;3";
@@ -847,6 +2102,20 @@ main(int argc, char *argv[], char *envp[])
     FILE *fp;
     struct stat sb;
     bool inherit = false; /* Inherit parent environment */
+    char *profile_path = NULL;
+    char *profile_map = NULL;
+    unsigned int profile_rate = PROFILE_DEFAULT_RATE;
+    enum profile_format profile_format = PROFILE_FOLDED;
+    char *glyphs = NULL;
+    struct text_geometry text_cell = {
+        TEXT_CELL_WIDTH, TEXT_CELL_HEIGHT, TEXT_ORIGIN_X, TEXT_ORIGIN_Y
+    };
+    char *shm = NULL;
+    char *metrics = NULL;
+    char *heatmap_log = NULL;
+    char *tee = NULL;
+
+    start_time = g_get_monotonic_time();
 
     snprintf(VERSION_STRING, 64, "%d.%d.%d",
              VERSION_MAJOR, VERSION_MINOR, VERSION_BUILD);
@@ -859,7 +2128,7 @@ main(int argc, char *argv[], char *envp[])
 
     int option_index = 0;
 
-    while ((c = getopt_long(argc, argv, "hivbd:n:t:p:s:f:",
+    while ((c = getopt_long(argc, argv, "hivbFHLd:n:t:p:s:f:P:S:m:T:",
                             long_options, &option_index)) != -1) {
         switch(c) {
         case 0:
@@ -888,6 +2157,75 @@ main(int argc, char *argv[], char *envp[])
         case 'f':
             firmware = optarg;
             break;
+        case 'F':
+            fast_boot = true;
+            break;
+        case 'P':
+            profile_path = optarg;
+            break;
+        case 'S':
+            shm = optarg;
+            break;
+        case 'H':
+            headless = true;
+            break;
+        case 'm':
+            metrics = optarg;
+            break;
+        case 'L':
+            low_latency = true;
+            break;
+        case 'T':
+            trace_file = optarg;
+            break;
+        case OPT_PROFILE_RATE:
+            profile_rate = (unsigned int) strtoul(optarg, NULL, 10);
+            break;
+        case OPT_GLYPHS:
+            glyphs = optarg;
+            break;
+        case OPT_LEARN_GLYPHS:
+            learn_glyphs = optarg;
+            break;
+        case OPT_TEXT_CELL:
+            if (screen_text_parse_geometry(optarg, &text_cell) < 0) {
+                errflg++;
+            }
+            break;
+        case OPT_WAIT_TEXT:
+            wait_text = optarg;
+            break;
+        case OPT_DUMP_TEXT:
+            dump_text = optarg;
+            break;
+        case OPT_TIMEOUT:
+            timeout_us = (gint64)(strtod(optarg, NULL) * 1000000);
+            break;
+        case OPT_HOST_POINTER:
+            host_pointer = true;
+            break;
+        case OPT_HEATMAP_LOG:
+            heatmap_log = optarg;
+            break;
+        case OPT_CONFIG:
+            config_path = optarg;
+            break;
+        case OPT_TEE:
+            tee = optarg;
+            break;
+        case OPT_PROFILE_MAP:
+            profile_map = optarg;
+            break;
+        case OPT_PROFILE_FORMAT:
+            if (strcmp(optarg, "folded") == 0) {
+                profile_format = PROFILE_FOLDED;
+            } else if (strcmp(optarg, "flat") == 0) {
+                profile_format = PROFILE_FLAT;
+            } else {
+                fprintf(stderr, "--profile-format must be one of either \"folded\" or \"flat\".\n");
+                errflg++;
+            }
+            break;
         case '?':
             fprintf(stderr, "Unrecognized option: -%c\n", optopt);
             errflg++;
@@ -900,7 +2238,17 @@ main(int argc, char *argv[], char *envp[])
         return -1;
     }
 
-    if (shell == NULL && device == NULL) {
+    trace_init(trace_file);
+
+    /* Only a config file named on the command line has to be right */
+    if (config_path == NULL) {
+        config_path = tuning_default_path();
+        tuning_load(config_path, false);
+    } else if (tuning_load(config_path, true) < 0) {
+        return -1;
+    }
+
+    if (learn_glyphs == NULL && shell == NULL && device == NULL) {
         fprintf(stderr, "Either --shell or --device is required.\n");
         return -1;
     }
@@ -910,7 +2258,17 @@ main(int argc, char *argv[], char *envp[])
         return -1;
     }
 
-    if (device == NULL) {
+    if ((wait_text != NULL || dump_text != NULL) && glyphs == NULL) {
+        fprintf(stderr, "--wait-text and --dump-text need a glyph table (--glyphs).\n");
+        return -1;
+    }
+
+    if (learn_glyphs != NULL) {
+        /* Learning runs headless, with nothing on the serial line */
+        headless = true;
+        fast_boot = true;
+        screen_text_init(&text_cell);
+    } else if (device == NULL) {
         if (stat(shell, &sb) != 0 || (sb.st_mode & S_IXUSR) == 0) {
             fprintf(stderr, "Cannot open %s as shell, or file is not executable.\n", shell);
             return -1;
@@ -940,6 +2298,31 @@ main(int argc, char *argv[], char *envp[])
         return -1;
     }
 
+    if (profile_path != NULL &&
+        profile_init(profile_path, profile_map, profile_rate, profile_format) < 0) {
+        return -1;
+    }
+
+    if (glyphs != NULL && screen_text_load(glyphs) < 0) {
+        return -1;
+    }
+
+    if (shm != NULL && shm_export_init(shm) < 0) {
+        return -1;
+    }
+
+    if (metrics != NULL && metrics_init(metrics) < 0) {
+        return -1;
+    }
+
+    if (heatmap_log != NULL && heatmap_init(heatmap_log) < 0) {
+        return -1;
+    }
+
+    if (tee != NULL && tee_init(tee) < 0) {
+        return -1;
+    }
+
     /* Load NVRAM, if any */
     if (nvram != NULL) {
         fp = fopen(nvram, "r");
@@ -967,9 +2350,18 @@ main(int argc, char *argv[], char *envp[])
         }
     }
 
-    gtk_setup(&argc, &argv);
-
-    gtk_main();
+    if (headless) {
+        /* Frames are still converted, as if to an always-visible
+         * window, so headless runs exercise the whole pipeline. */
+        frame_ring_init(NULL);
+        display_visible = true;
+        main_loop = g_main_loop_new(NULL, FALSE);
+        g_timeout_add(HEADLESS_POLL_MS, headless_main_loop, NULL);
+        g_main_loop_run(main_loop);
+    } else {
+        gtk_setup(&argc, &argv);
+        gtk_main();
+    }
 
-    return 0;
+    return exit_status;
 }
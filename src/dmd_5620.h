@@ -28,8 +28,10 @@
 #define __DMD_5620_H__
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <gmodule.h>
 #include <gtk/gtk.h>
+#include <glib-unix.h>
 
 #define WIDTH 800
 #define WIDTH_IN_BYTES 100
@@ -46,10 +48,15 @@ struct color
     uint8_t a;
 };
 
-const struct color COLOR_LIGHT = { 0, 255, 0, 255 };
-const struct color COLOR_DARK = { 0, 0, 0, 255 };
+static const struct color COLOR_LIGHT = { 0, 255, 0, 255 };
+static const struct color COLOR_DARK = { 0, 0, 0, 255 };
 
-/* dmd_core exported functions */
+/*
+ * dmd_core exported functions. These return 0 on success and non-zero
+ * on failure. dmd_rs232_tx and dmd_keyboard_tx fail when there is no
+ * byte waiting. The receive calls fail only if the core could not be
+ * reached, and a byte that fails is not taken.
+ */
 extern uint8_t *dmd_video_ram();
 extern int dmd_video_ram_dirty();
 extern int dmd_init(uint8_t version);
@@ -72,13 +79,53 @@ extern int dmd_get_nvram(uint8_t *buf);
 void int_handler(int signal);
 /* int tx_send(int sock, const char *buffer, size_t size); */
 void close_window();
+size_t rs232_rx_buf(const uint8_t *buf, size_t len);
+size_t rs232_tx_buf(uint8_t *buf, size_t len);
+void rx_received(size_t len);
+void tx_flush(int fd);
+void shell_exited();
 void pty_io_poll();
 void tty_io_poll();
 gboolean configure_handler(GtkWidget *widget,
                                   GdkEventConfigure *event,
                                   gpointer data);
+void boot_ready(bool timed_out);
+void check_ready(size_t steps);
+void step_core(size_t steps);
+void simulation_step(size_t now);
+void io_poll();
+void capped_refresh(GtkWidget *widget);
+bool input_burst();
+gboolean input_echo_handler(gint fd, GIOCondition condition, gpointer data);
+void input_event(bool burst);
+void run_tick(GtkWidget *widget, size_t now);
+bool inject_host_bytes(const char *bytes, size_t len, size_t *sent);
+gboolean learn_step();
+void write_screen_text(const char *path);
+void copy_screen_text();
+void performance_changed(GtkWidget *widget, gpointer data);
+gboolean performance_readout(gpointer data);
+void performance_response(GtkDialog *dialog, gint response, gpointer data);
+GtkWidget *performance_spin(GtkWidget *grid, int row, const char *text,
+                            double min, double max, double step, guint digits, double value);
+void show_performance();
+void toggle_heatmap(GtkCheckMenuItem *item, gpointer data);
 gboolean simulation_main_loop(GtkWidget *widget, GdkFrameClock *clock, gpointer data);
+gboolean hidden_main_loop(gpointer data);
+gboolean headless_main_loop(gpointer data);
+void update_visibility(GtkWidget *widget);
+gboolean map_handler(GtkWidget *widget, GdkEvent *event, gpointer data);
+gboolean visibility_handler(GtkWidget *widget, GdkEventVisibility *event, gpointer data);
+gboolean window_state_handler(GtkWidget *widget, GdkEventWindowState *event, gpointer data);
 gboolean refresh_display(GtkWidget *widget, gpointer data);
+void frame_ring_init(GdkWindow *window);
+void frame_ring_destroy();
+void frame_publish();
+cairo_surface_t *frame_latest();
+int diff_rows(const uint8_t *vram, uint8_t *written, int *first, int *last);
+void latch_video_dirty();
+bool video_rows_written(uint8_t *rows);
+void build_expand_table(const struct color *fg, const struct color *bg);
 gboolean draw_handler(GtkWidget *widget, cairo_t *cr, gpointer data);
 gboolean mouse_moved(GtkWidget *widget, GdkEventMotion *event, gpointer data);
 gboolean mouse_button(GtkWidget *widget, GdkEventButton *event, gpointer data);
@@ -0,0 +1,81 @@
+/*
+ * This file is part of the GTK+ DMD 5620 Emultor.
+ *
+ * Copyright 2018, Seth Morabito <web@loomcom.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DMD_SHM_H__
+#define __DMD_SHM_H__
+
+#include <stdint.h>
+
+/*
+ * Layout of the shared-memory framebuffer published with --shm NAME.
+ *
+ * Consumers shm_open() the name read-only and mmap() it. "seq" works
+ * as a sequence lock: it is odd while a frame is being written and is
+ * incremented to an even value once the frame is complete. The writer
+ * increments it to odd, issues a release fence, writes the frame, and
+ * increments it to even with a release store. A reader should:
+ *
+ *   1. load "seq" with acquire ordering, and retry if it is odd;
+ *   2. copy what it needs;
+ *   3. issue an acquire fence and load "seq" again;
+ *   4. use the copy only if "seq" is unchanged, and retry otherwise.
+ *
+ * With GCC or Clang that is __atomic_load_n(&seq, __ATOMIC_ACQUIRE)
+ * and __atomic_thread_fence(__ATOMIC_ACQUIRE). On Linux, a reader may
+ * block until the next frame with FUTEX_WAIT on "seq" (the segment is
+ * shared, so the non-private futex operations must be used).
+ *
+ * "dirty" has one bit per row (row N is bit N % 8 of byte N / 8) for
+ * the rows that changed from the previous frame. Readers that skipped
+ * frames, as shown by "frame", should treat every row as dirty.
+ *
+ * "vram" is the raw 1 bit per pixel video memory, most significant
+ * bit leftmost. Set bits are drawn in the foreground colour, which is
+ * dark-on-light when "palette" is 1 and light-on-dark when it is 0.
+ */
+
+#define DMD_SHM_MAGIC    0x53444d44   /* "DMDS" */
+#define DMD_SHM_VERSION  1
+#define DMD_SHM_WIDTH    800
+#define DMD_SHM_HEIGHT   1024
+#define DMD_SHM_STRIDE   100
+
+struct dmd_shm
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    volatile uint32_t seq;
+    volatile uint32_t palette;
+    uint32_t reserved;
+    volatile uint64_t frame;
+    uint8_t dirty[DMD_SHM_HEIGHT / 8];
+    uint8_t vram[DMD_SHM_STRIDE * DMD_SHM_HEIGHT];
+};
+
+#endif
@@ -0,0 +1,249 @@
+/*
+ * This file is part of the GTK+ DMD 5620 Emultor.
+ *
+ * Copyright 2018, Seth Morabito <web@loomcom.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dmd_5620.h"
+#include "heatmap.h"
+
+/* Heat kept from one tick to the next, and the heat drawn at full
+ * intensity (two complete rewrites of a tile) */
+#define HEAT_DECAY     0.95f
+#define HEAT_FULL      (2.0f * HEAT_TILE * HEAT_TILE / 8)
+
+#define HEAT_LOG_US    1000000
+
+bool heatmap_enabled = false;
+bool heatmap_visible = false;
+
+static uint8_t *shadow = NULL;
+static bool primed = false;
+static float heat[HEAT_ROWS][HEAT_COLS];
+
+/* Totals for the current summary period */
+static uint32_t period_bytes[HEAT_ROWS][HEAT_COLS];
+static uint64_t period_rows = 0;
+static gint64 period_start = 0;
+static unsigned long period = 0;
+
+static FILE *heat_log = NULL;
+
+static int
+start()
+{
+    if (shadow == NULL) {
+        shadow = calloc(1, VIDRAM_SIZE);
+        if (shadow == NULL) {
+            fprintf(stderr, "Could not allocate the heatmap.\n");
+            return -1;
+        }
+    }
+
+    heatmap_enabled = true;
+
+    return 0;
+}
+
+/*
+ * Start collecting heat, logging a summary line per second to
+ * log_path if it is not NULL.
+ */
+int
+heatmap_init(const char *log_path)
+{
+    if (log_path != NULL) {
+        heat_log = fopen(log_path, "w");
+        if (heat_log == NULL) {
+            fprintf(stderr, "Could not open heatmap log %s for writing.\n", log_path);
+            return -1;
+        }
+        fprintf(heat_log, "second,bytes_changed,rows_changed,tiles_changed,"
+                "hottest_x,hottest_y,hottest_bytes\n");
+    }
+
+    return start();
+}
+
+/*
+ * Show or hide the overlay. Heat is only collected while it is shown
+ * or being logged.
+ */
+void
+heatmap_show(bool show)
+{
+    heatmap_visible = show;
+
+    if (show) {
+        start();
+    } else if (heat_log == NULL) {
+        heatmap_enabled = false;
+        primed = false;
+        memset(heat, 0, sizeof(heat));
+    }
+}
+
+static void
+write_summary()
+{
+    uint64_t bytes = 0;
+    unsigned int tiles = 0, hot_x = 0, hot_y = 0;
+    uint32_t hottest = 0;
+
+    for (int ty = 0; ty < HEAT_ROWS; ty++) {
+        for (int tx = 0; tx < HEAT_COLS; tx++) {
+            uint32_t n = period_bytes[ty][tx];
+
+            if (n == 0) {
+                continue;
+            }
+
+            bytes += n;
+            tiles++;
+
+            if (n > hottest) {
+                hottest = n;
+                hot_x = tx * HEAT_TILE;
+                hot_y = ty * HEAT_TILE;
+            }
+        }
+    }
+
+    fprintf(heat_log, "%lu,%lu,%lu,%u,%u,%u,%u\n",
+            period, (unsigned long) bytes, (unsigned long) period_rows,
+            tiles, hot_x, hot_y, hottest);
+    fflush(heat_log);
+
+    memset(period_bytes, 0, sizeof(period_bytes));
+    period_rows = 0;
+}
+
+/*
+ * Compare video RAM with the previous sample, tile by tile, and add
+ * the changed bytes to the heat.
+ */
+void
+heatmap_sample(const uint8_t *vram, gint64 now)
+{
+    if (!heatmap_enabled || vram == NULL) {
+        return;
+    }
+
+    /* The screen as it was when collection started is not heat */
+    if (!primed) {
+        memcpy(shadow, vram, VIDRAM_SIZE);
+        primed = true;
+        return;
+    }
+
+    for (int ty = 0; ty < HEAT_ROWS; ty++) {
+        for (int tx = 0; tx < HEAT_COLS; tx++) {
+            heat[ty][tx] *= HEAT_DECAY;
+        }
+    }
+
+    for (int y = 0; y < HEIGHT; y++) {
+        size_t offset = y * WIDTH_IN_BYTES;
+        float *row_heat = heat[y / HEAT_TILE];
+        uint32_t *row_bytes = period_bytes[y / HEAT_TILE];
+
+        if (memcmp(shadow + offset, vram + offset, WIDTH_IN_BYTES) == 0) {
+            continue;
+        }
+
+        period_rows++;
+
+        for (int x = 0; x < WIDTH_IN_BYTES; x++) {
+            if (shadow[offset + x] != vram[offset + x]) {
+                row_heat[x * 8 / HEAT_TILE] += 1.0f;
+                row_bytes[x * 8 / HEAT_TILE]++;
+            }
+        }
+
+        memcpy(shadow + offset, vram + offset, WIDTH_IN_BYTES);
+    }
+
+    if (heat_log != NULL) {
+        if (period_start == 0) {
+            period_start = now;
+        } else if (now - period_start >= HEAT_LOG_US) {
+            write_summary();
+            period_start += HEAT_LOG_US;
+            period++;
+        }
+    }
+}
+
+/*
+ * Draw the heat over the display: dark red for the odd write, through
+ * yellow, to white for tiles rewritten every frame.
+ */
+void
+heatmap_draw(cairo_t *cr)
+{
+    if (!heatmap_visible) {
+        return;
+    }
+
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+
+    for (int ty = 0; ty < HEAT_ROWS; ty++) {
+        for (int tx = 0; tx < HEAT_COLS; tx++) {
+            float t = heat[ty][tx] / HEAT_FULL;
+
+            if (t < 0.01f) {
+                continue;
+            }
+            if (t > 1.0f) {
+                t = 1.0f;
+            }
+
+            cairo_set_source_rgba(cr,
+                                  CLAMP(3.0f * t, 0.0f, 1.0f),
+                                  CLAMP(3.0f * t - 1.0f, 0.0f, 1.0f),
+                                  CLAMP(3.0f * t - 2.0f, 0.0f, 1.0f),
+                                  0.25f + 0.5f * t);
+            cairo_rectangle(cr, tx * HEAT_TILE, ty * HEAT_TILE, HEAT_TILE, HEAT_TILE);
+            cairo_fill(cr);
+        }
+    }
+}
+
+void
+heatmap_close()
+{
+    if (heat_log != NULL) {
+        write_summary();
+        fclose(heat_log);
+        heat_log = NULL;
+    }
+
+    free(shadow);
+    shadow = NULL;
+    primed = false;
+    heatmap_enabled = false;
+}
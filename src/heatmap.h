@@ -0,0 +1,54 @@
+/*
+ * This file is part of the GTK+ DMD 5620 Emultor.
+ *
+ * Copyright 2018, Seth Morabito <web@loomcom.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __HEATMAP_H__
+#define __HEATMAP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <gtk/gtk.h>
+
+/*
+ * Video RAM write heatmap. The screen is divided into tiles, and the
+ * number of bytes that changed in each tile is accumulated from frame
+ * to frame with exponential decay. The heat can be drawn over the
+ * display, and a per-second summary can be logged as CSV.
+ */
+
+#define HEAT_TILE      16
+#define HEAT_COLS      (WIDTH / HEAT_TILE)
+#define HEAT_ROWS      (HEIGHT / HEAT_TILE)
+
+extern bool heatmap_enabled;
+extern bool heatmap_visible;
+
+int heatmap_init(const char *log_path);
+void heatmap_show(bool show);
+void heatmap_sample(const uint8_t *vram, gint64 now);
+void heatmap_draw(cairo_t *cr);
+void heatmap_close();
+
+#endif
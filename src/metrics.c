@@ -0,0 +1,318 @@
+/*
+ * This file is part of the GTK+ DMD 5620 Emultor.
+ *
+ * Copyright 2018, Seth Morabito <web@loomcom.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "metrics.h"
+
+#define METRICS_BUF_LEN     8192
+#define METRICS_REQ_LEN     1024
+#define METRICS_TIMEOUT_MS  1000
+
+struct cpu_metrics cpu_metrics;
+struct video_metrics video_metrics;
+struct serial_metrics serial_metrics;
+struct input_metrics input_metrics;
+struct tick_metrics tick_metrics;
+struct nvram_metrics nvram_metrics;
+
+static const uint64_t tick_bounds[TICK_BUCKETS] = TICK_BUCKET_BOUNDS;
+static const double tick_quantiles[] = { 0.5, 0.9, 0.99 };
+
+static char *socket_path = NULL;
+static int listen_fd = -1;
+static pthread_t server_thread;
+
+void
+metrics_tick(uint64_t duration_us)
+{
+    int i;
+
+    /* The last bucket has no upper bound */
+    for (i = 0; i < TICK_BUCKETS - 1; i++) {
+        if (duration_us <= tick_bounds[i]) {
+            break;
+        }
+    }
+
+    METRIC_ADD(tick_metrics.buckets[i], 1);
+    METRIC_ADD(tick_metrics.sum_us, duration_us);
+    METRIC_ADD(tick_metrics.count, 1);
+}
+
+/*
+ * Estimate a quantile from the histogram, as the upper bound of the
+ * bucket it falls into.
+ */
+static double
+tick_quantile(const uint64_t *buckets, uint64_t count, double q)
+{
+    uint64_t target = (uint64_t)(q * count);
+    uint64_t seen = 0;
+
+    for (int i = 0; i < TICK_BUCKETS - 1; i++) {
+        seen += buckets[i];
+        if (seen > target) {
+            return tick_bounds[i] / 1e6;
+        }
+    }
+
+    return tick_bounds[TICK_BUCKETS - 2] / 1e6;
+}
+
+#define APPEND(...) \
+    len += snprintf(buf + len, len < size ? size - len : 0, __VA_ARGS__)
+
+#define COUNTER(name, help, value)                                  \
+    APPEND("# HELP " name " " help "\n# TYPE " name " counter\n"    \
+           name " %lu\n", (unsigned long)(value))
+
+#define GAUGE(name, help, fmt, value)                               \
+    APPEND("# HELP " name " " help "\n# TYPE " name " gauge\n"      \
+           name " " fmt "\n", value)
+
+static size_t
+format_metrics(char *buf, size_t size)
+{
+    size_t len = 0;
+    uint64_t buckets[TICK_BUCKETS];
+    uint64_t count, cumulative = 0;
+
+    COUNTER("dmd_steps_total", "CPU steps executed.",
+            METRIC_GET(cpu_metrics.steps));
+    GAUGE("dmd_emulated_mhz", "Effective emulated CPU clock rate.",
+          "%.3f", METRIC_GET(cpu_metrics.rate_hz) / 1e6);
+    GAUGE("dmd_time_to_ready_seconds", "Time from startup until the firmware was ready.",
+          "%.3f", METRIC_GET(cpu_metrics.ready_us) / 1e6);
+    COUNTER("dmd_frames_converted_total", "Frames converted for display.",
+            METRIC_GET(video_metrics.frames_converted));
+    COUNTER("dmd_frames_skipped_total", "Changed frames not converted because the window was hidden.",
+            METRIC_GET(video_metrics.frames_skipped));
+    COUNTER("dmd_rows_converted_total", "Display rows converted.",
+            METRIC_GET(video_metrics.rows_converted));
+    COUNTER("dmd_rs232_rx_bytes_total", "Bytes received from the host.",
+            METRIC_GET(serial_metrics.rx_bytes));
+    COUNTER("dmd_rs232_tx_bytes_total", "Bytes transmitted to the host.",
+            METRIC_GET(serial_metrics.tx_bytes));
+    COUNTER("dmd_rs232_rx_dropped_total", "Received bytes refused by the DUART.",
+            METRIC_GET(serial_metrics.rx_dropped));
+    COUNTER("dmd_keyboard_events_total", "Keyboard events.",
+            METRIC_GET(input_metrics.keyboard_events));
+    COUNTER("dmd_mouse_events_total", "Mouse motion and button events.",
+            METRIC_GET(input_metrics.mouse_events));
+    COUNTER("dmd_input_bursts_total", "Emulation bursts run early for input (--low-latency).",
+            METRIC_GET(input_metrics.bursts));
+    APPEND("# HELP dmd_input_latency_seconds Time from input event to converted frame.\n"
+           "# TYPE dmd_input_latency_seconds summary\n"
+           "dmd_input_latency_seconds_sum %.6f\n"
+           "dmd_input_latency_seconds_count %lu\n",
+           METRIC_GET(input_metrics.latency_sum_us) / 1e6,
+           (unsigned long) METRIC_GET(input_metrics.latency_count));
+    COUNTER("dmd_nvram_flushes_total", "NVRAM writes to disk.",
+            METRIC_GET(nvram_metrics.flushes));
+
+    /* Take one consistent-enough snapshot of the histogram */
+    count = 0;
+    for (int i = 0; i < TICK_BUCKETS; i++) {
+        buckets[i] = METRIC_GET(tick_metrics.buckets[i]);
+        count += buckets[i];
+    }
+
+    APPEND("# HELP dmd_tick_duration_seconds Time spent in each emulation tick.\n"
+           "# TYPE dmd_tick_duration_seconds histogram\n");
+    for (int i = 0; i < TICK_BUCKETS - 1; i++) {
+        cumulative += buckets[i];
+        APPEND("dmd_tick_duration_seconds_bucket{le=\"%g\"} %lu\n",
+               tick_bounds[i] / 1e6, (unsigned long) cumulative);
+    }
+    APPEND("dmd_tick_duration_seconds_bucket{le=\"+Inf\"} %lu\n", (unsigned long) count);
+    APPEND("dmd_tick_duration_seconds_sum %.6f\n",
+           METRIC_GET(tick_metrics.sum_us) / 1e6);
+    APPEND("dmd_tick_duration_seconds_count %lu\n", (unsigned long) count);
+
+    APPEND("# HELP dmd_tick_duration_quantile_seconds Estimated tick duration percentiles.\n"
+           "# TYPE dmd_tick_duration_quantile_seconds gauge\n");
+    for (size_t i = 0; i < sizeof(tick_quantiles) / sizeof(tick_quantiles[0]); i++) {
+        APPEND("dmd_tick_duration_quantile_seconds{quantile=\"%g\"} %g\n",
+               tick_quantiles[i],
+               count ? tick_quantile(buckets, count, tick_quantiles[i]) : 0.0);
+    }
+
+    return len < size ? len : size - 1;
+}
+
+/*
+ * Send with MSG_NOSIGNAL, so a scraper that hangs up early can't kill
+ * the terminal with SIGPIPE.
+ */
+static void
+write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/*
+ * Serve one scrape per connection. A plain HTTP/1.0 response is sent
+ * whatever the request was, so both "curl --unix-socket" and a raw
+ * "nc -U" work.
+ */
+static void *
+metrics_server(void *arg)
+{
+    char body[METRICS_BUF_LEN];
+    char header[128];
+    char request[METRICS_REQ_LEN];
+    struct pollfd pfd;
+    size_t len;
+    int fd;
+
+    for (;;) {
+        fd = accept(listen_fd, NULL, NULL);
+
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        /* Drain the request line, if the client sends one */
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, METRICS_TIMEOUT_MS) > 0) {
+            if (read(fd, request, sizeof(request)) < 0) {
+                close(fd);
+                continue;
+            }
+        }
+
+        len = format_metrics(body, sizeof(body));
+        snprintf(header, sizeof(header),
+                 "HTTP/1.0 200 OK\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %lu\r\n\r\n", (unsigned long) len);
+
+        write_all(fd, header, strlen(header));
+        write_all(fd, body, len);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+int
+metrics_init(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    mode_t mask;
+    int status;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Metrics socket path %s is too long.\n", path);
+        return -1;
+    }
+
+    /* Remove a stale socket left behind by an earlier run, but
+     * nothing else that happens to be at the path */
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Metrics socket path %s exists and is not a socket.\n", path);
+            return -1;
+        }
+        unlink(path);
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (listen_fd < 0) {
+        fprintf(stderr, "error %d creating metrics socket: %s\n",
+                errno, strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    /* Only the user running the terminal may connect */
+    mask = umask(0077);
+    status = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+
+    if (status < 0 || listen(listen_fd, 4) < 0) {
+        fprintf(stderr, "error %d binding metrics socket %s: %s\n",
+                errno, path, strerror(errno));
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+
+    socket_path = strdup(path);
+
+    if (pthread_create(&server_thread, NULL, metrics_server, NULL) != 0) {
+        fprintf(stderr, "Could not start metrics server thread.\n");
+        metrics_close();
+        return -1;
+    }
+
+    pthread_detach(server_thread);
+
+    return 0;
+}
+
+void
+metrics_close()
+{
+    if (listen_fd >= 0) {
+        shutdown(listen_fd, SHUT_RDWR);
+        close(listen_fd);
+        listen_fd = -1;
+    }
+
+    if (socket_path != NULL) {
+        unlink(socket_path);
+        free(socket_path);
+        socket_path = NULL;
+    }
+}
@@ -0,0 +1,103 @@
+/*
+ * This file is part of the GTK+ DMD 5620 Emultor.
+ *
+ * Copyright 2018, Seth Morabito <web@loomcom.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Emulator counters. Each subsystem has its own cache line, and all
+ * updates are relaxed atomic adds, so counting on the hot path is
+ * about as cheap as an ordinary increment. The counters are always
+ * maintained; --metrics only controls whether they are served.
+ */
+
+#define METRICS_ALIGN __attribute__((aligned(64)))
+
+#define METRIC_ADD(m, n) __atomic_fetch_add(&(m), (n), __ATOMIC_RELAXED)
+#define METRIC_SET(m, v) __atomic_store_n(&(m), (v), __ATOMIC_RELAXED)
+#define METRIC_GET(m)    __atomic_load_n(&(m), __ATOMIC_RELAXED)
+
+/* Upper bounds of the tick duration histogram buckets, in microseconds */
+#define TICK_BUCKETS 10
+#define TICK_BUCKET_BOUNDS { 250, 500, 1000, 2000, 4000, 8000, 16000, 33000, 66000, 0 }
+
+struct cpu_metrics
+{
+    uint64_t steps;
+    uint64_t rate_hz;
+    uint64_t ready_us;
+} METRICS_ALIGN;
+
+struct video_metrics
+{
+    uint64_t frames_converted;
+    uint64_t frames_skipped;
+    uint64_t rows_converted;
+} METRICS_ALIGN;
+
+struct serial_metrics
+{
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+    uint64_t rx_dropped;
+} METRICS_ALIGN;
+
+struct input_metrics
+{
+    uint64_t keyboard_events;
+    uint64_t mouse_events;
+    uint64_t bursts;
+    uint64_t latency_count;
+    uint64_t latency_sum_us;
+} METRICS_ALIGN;
+
+struct tick_metrics
+{
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t buckets[TICK_BUCKETS];
+} METRICS_ALIGN;
+
+struct nvram_metrics
+{
+    uint64_t flushes;
+} METRICS_ALIGN;
+
+extern struct cpu_metrics cpu_metrics;
+extern struct video_metrics video_metrics;
+extern struct serial_metrics serial_metrics;
+extern struct input_metrics input_metrics;
+extern struct tick_metrics tick_metrics;
+extern struct nvram_metrics nvram_metrics;
+
+void metrics_tick(uint64_t duration_us);
+int metrics_init(const char *path);
+void metrics_close();
+
+#endif
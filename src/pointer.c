@@ -0,0 +1,316 @@
+/*
+ * This file is part of the GTK+ DMD 5620 Emultor.
+ *
+ * Copyright 2018, Seth Morabito <web@loomcom.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dmd_5620.h"
+#include "pointer.h"
+#include "tuning.h"
+
+/* Area searched for the sprite, centred on the pointer */
+#define WIN_BYTES     8
+#define WIN_ROWS      64
+
+/* Emulated seconds after the last move before the guest is assumed
+ * to have drawn its sprite */
+#define SETTLE_SEC    0.05
+
+/* How far the pointer must move for the old area to be clear of it */
+#define AWAY_PX       (2 * POINTER_SIZE)
+
+/* Fewer set pixels than this is not taken for a sprite */
+#define MIN_PIXELS    6
+
+struct sprite
+{
+    uint16_t rows[POINTER_SIZE];
+    int hot_x;
+    int hot_y;
+};
+
+bool host_pointer = false;
+
+static GtkWidget *pointer_widget = NULL;
+static GdkCursor *cursor = NULL;
+
+static int cur_x = -1, cur_y = -1;
+static uint64_t move_count = 0;
+static uint64_t move_steps = 0;
+static bool moved = false;
+
+static bool have_rest = false;
+static int rest_x, rest_y;
+static uint64_t rest_moves = 0;
+static uint8_t rest_win[WIN_ROWS][WIN_BYTES];
+
+static struct sprite current;
+static struct sprite candidate;
+static bool have_current = false;
+static bool have_candidate = false;
+
+void
+pointer_init(GtkWidget *widget)
+{
+    pointer_widget = widget;
+}
+
+/*
+ * Called with every pointer motion, in screen coordinates.
+ */
+void
+pointer_moved(int x, int y)
+{
+    cur_x = x;
+    cur_y = y;
+    move_count++;
+    moved = true;
+}
+
+static int
+win_left(int x)
+{
+    int bx = (x - (WIN_BYTES * 8) / 2) / 8;
+
+    if (bx < 0) {
+        bx = 0;
+    }
+    if (bx > WIDTH_IN_BYTES - WIN_BYTES) {
+        bx = WIDTH_IN_BYTES - WIN_BYTES;
+    }
+
+    return bx;
+}
+
+static int
+win_top(int y)
+{
+    int top = y - WIN_ROWS / 2;
+
+    if (top < 0) {
+        top = 0;
+    }
+    if (top > HEIGHT - WIN_ROWS) {
+        top = HEIGHT - WIN_ROWS;
+    }
+
+    return top;
+}
+
+static void
+capture(const uint8_t *vram, int x, int y, uint8_t win[WIN_ROWS][WIN_BYTES])
+{
+    int bx = win_left(x);
+    int top = win_top(y);
+
+    for (int row = 0; row < WIN_ROWS; row++) {
+        memcpy(win[row], vram + (top + row) * WIDTH_IN_BYTES + bx, WIN_BYTES);
+    }
+}
+
+static bool
+bit(uint8_t win[WIN_ROWS][WIN_BYTES], int px, int row)
+{
+    return (win[row][px / 8] >> (7 - (px % 8))) & 1;
+}
+
+/*
+ * Look for a sprite in the difference between the area around (x, y)
+ * with and without the guest's cursor in it. Anything bigger than a
+ * sprite means something else was drawn there meanwhile.
+ */
+static bool
+extract(uint8_t diff[WIN_ROWS][WIN_BYTES], int x, int y, struct sprite *sp)
+{
+    int left = WIN_BYTES * 8, right = -1, top = WIN_ROWS, bottom = -1;
+    int pixels = 0;
+
+    for (int row = 0; row < WIN_ROWS; row++) {
+        for (int px = 0; px < WIN_BYTES * 8; px++) {
+            if (bit(diff, px, row)) {
+                left = MIN(left, px);
+                right = MAX(right, px);
+                top = MIN(top, row);
+                bottom = MAX(bottom, row);
+                pixels++;
+            }
+        }
+    }
+
+    if (pixels < MIN_PIXELS ||
+        right - left >= POINTER_SIZE || bottom - top >= POINTER_SIZE) {
+        return false;
+    }
+
+    memset(sp, 0, sizeof(*sp));
+
+    for (int row = top; row <= bottom; row++) {
+        for (int px = left; px <= right; px++) {
+            if (bit(diff, px, row)) {
+                sp->rows[row - top] |= 1 << (POINTER_SIZE - 1 - (px - left));
+            }
+        }
+    }
+
+    /* The pointer position relative to the sprite's top left corner */
+    sp->hot_x = CLAMP(x - (win_left(x) * 8 + left), 0, POINTER_SIZE - 1);
+    sp->hot_y = CLAMP(y - (win_top(y) + top), 0, POINTER_SIZE - 1);
+
+    return true;
+}
+
+static bool
+sprite_set(const struct sprite *sp, int px, int row)
+{
+    if (px < 0 || px >= POINTER_SIZE || row < 0 || row >= POINTER_SIZE) {
+        return false;
+    }
+
+    return (sp->rows[row] >> (POINTER_SIZE - 1 - px)) & 1;
+}
+
+/*
+ * Turn the sprite into a native cursor: the sprite in the screen's
+ * foreground colour with a dark outline, so it shows on either
+ * polarity.
+ */
+static void
+apply_sprite(const struct sprite *sp)
+{
+    GdkWindow *window;
+    GdkPixbuf *pixbuf;
+    guchar *pixels;
+    int stride;
+
+    if (pointer_widget == NULL ||
+        (window = gtk_widget_get_window(pointer_widget)) == NULL) {
+        return;
+    }
+
+    pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, POINTER_SIZE, POINTER_SIZE);
+    pixels = gdk_pixbuf_get_pixels(pixbuf);
+    stride = gdk_pixbuf_get_rowstride(pixbuf);
+
+    for (int row = 0; row < POINTER_SIZE; row++) {
+        for (int px = 0; px < POINTER_SIZE; px++) {
+            guchar *p = pixels + row * stride + px * 4;
+            bool edge = false;
+
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    edge |= sprite_set(sp, px + dx, row + dy);
+                }
+            }
+
+            if (sprite_set(sp, px, row)) {
+                p[0] = COLOR_LIGHT.r;
+                p[1] = COLOR_LIGHT.g;
+                p[2] = COLOR_LIGHT.b;
+                p[3] = 255;
+            } else if (edge) {
+                p[0] = COLOR_DARK.r;
+                p[1] = COLOR_DARK.g;
+                p[2] = COLOR_DARK.b;
+                p[3] = 255;
+            } else {
+                p[0] = p[1] = p[2] = p[3] = 0;
+            }
+        }
+    }
+
+    if (cursor != NULL) {
+        g_object_unref(cursor);
+    }
+
+    cursor = gdk_cursor_new_from_pixbuf(gdk_window_get_display(window),
+                                        pixbuf, sp->hot_x, sp->hot_y);
+    gdk_window_set_cursor(window, cursor);
+    g_object_unref(pixbuf);
+}
+
+/*
+ * Called once per tick with the current screen and the total number
+ * of steps run. A sprite is only adopted once it has been seen the
+ * same way twice in a row.
+ */
+void
+pointer_update(const uint8_t *vram, uint64_t steps)
+{
+    uint8_t win[WIN_ROWS][WIN_BYTES];
+    struct sprite sp;
+
+    if (!host_pointer || cur_x < 0 || vram == NULL) {
+        return;
+    }
+
+    if (moved) {
+        moved = false;
+        move_steps = steps;
+        return;
+    }
+
+    if (move_count == rest_moves || steps - move_steps < tuning_steps(SETTLE_SEC)) {
+        return;
+    }
+
+    if (have_rest &&
+        (abs(cur_x - rest_x) >= AWAY_PX || abs(cur_y - rest_y) >= AWAY_PX)) {
+        capture(vram, rest_x, rest_y, win);
+
+        for (int row = 0; row < WIN_ROWS; row++) {
+            for (int b = 0; b < WIN_BYTES; b++) {
+                win[row][b] ^= rest_win[row][b];
+            }
+        }
+
+        if (extract(win, rest_x, rest_y, &sp)) {
+            if (have_candidate && memcmp(&sp, &candidate, sizeof(sp)) == 0 &&
+                (!have_current || memcmp(&sp, &current, sizeof(sp)) != 0)) {
+                current = sp;
+                have_current = true;
+                apply_sprite(&current);
+            }
+            candidate = sp;
+            have_candidate = true;
+        }
+    }
+
+    capture(vram, cur_x, cur_y, rest_win);
+    rest_x = cur_x;
+    rest_y = cur_y;
+    rest_moves = move_count;
+    have_rest = true;
+}
+
+void
+pointer_close()
+{
+    if (cursor != NULL) {
+        g_object_unref(cursor);
+        cursor = NULL;
+    }
+}
@@ -0,0 +1,365 @@
+/*
+ * This file is part of the GTK+ DMD 5620 Emultor.
+ *
+ * Copyright 2018, Seth Morabito <web@loomcom.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dmd_5620.h"
+#include "profile.h"
+#include "tuning.h"
+
+#define PSW_REGISTER   11
+#define PSW_CM_SHIFT   11
+#define PSW_CM_MASK    0x3
+#define MAP_LINE_LEN   256
+
+struct symbol
+{
+    uint32_t addr;
+    uint32_t size;      /* 0 if the map didn't give one */
+    char *name;
+};
+
+struct profile_entry
+{
+    const char *key;
+    size_t count;
+};
+
+static const char *MODE_NAMES[] = {
+    "kernel", "executive", "supervisor", "user"
+};
+
+bool profiling = false;
+
+static char *out_path = NULL;
+static enum profile_format out_format = PROFILE_FOLDED;
+static unsigned int sample_rate = 0;
+static size_t sample_interval = 0;
+static size_t countdown = 0;
+static size_t total_samples = 0;
+
+/* Sample counts keyed by (mode << 32 | pc) */
+static GHashTable *samples = NULL;
+
+static struct symbol *symbols = NULL;
+static size_t symbol_count = 0;
+
+static int
+symbol_compare(const void *a, const void *b)
+{
+    const struct symbol *sa = a;
+    const struct symbol *sb = b;
+
+    if (sa->addr < sb->addr) {
+        return -1;
+    }
+
+    return sa->addr > sb->addr;
+}
+
+/*
+ * Load a symbol map. Each line holds a hexadecimal address followed by
+ * a name; an optional type letter in between (as printed by "nm") is
+ * ignored. With four fields, as printed by "nm -S", the second is the
+ * symbol's size in hexadecimal.
+ */
+static int
+load_map(const char *path)
+{
+    FILE *fp;
+    char line[MAP_LINE_LEN];
+    char field[4][MAP_LINE_LEN];
+    char *end;
+    unsigned long addr, size;
+    size_t capacity = 0;
+
+    fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open symbol map %s.\n", path);
+        return -1;
+    }
+
+    while (fgets(line, MAP_LINE_LEN, fp) != NULL) {
+        int fields = sscanf(line, "%255s %255s %255s %255s",
+                            field[0], field[1], field[2], field[3]);
+
+        if (fields < 2) {
+            continue;
+        }
+
+        addr = strtoul(field[0], &end, 16);
+        if (*end != '\0') {
+            continue;
+        }
+
+        size = 0;
+        if (fields == 4) {
+            size = strtoul(field[1], &end, 16);
+            if (*end != '\0') {
+                continue;
+            }
+        }
+
+        if (symbol_count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            symbols = realloc(symbols, capacity * sizeof(struct symbol));
+        }
+
+        symbols[symbol_count].addr = (uint32_t) addr;
+        symbols[symbol_count].size = (uint32_t) size;
+        symbols[symbol_count].name = strdup(field[fields - 1]);
+        symbol_count++;
+    }
+
+    fclose(fp);
+
+    qsort(symbols, symbol_count, sizeof(struct symbol), symbol_compare);
+
+    return 0;
+}
+
+/*
+ * Name the symbol containing pc. A symbol ends where its size says,
+ * or without one, at the next symbol. The last symbol in a map without
+ * sizes is taken as an end marker (like "_etext" or "end") and covers
+ * only its own address. Anything outside every symbol, such as
+ * firmware code when the map is for a user program, is shown as a
+ * raw address.
+ */
+static const char *
+resolve(uint32_t pc, char *buf, size_t len)
+{
+    size_t lo = 0;
+    size_t hi = symbol_count;
+    uint64_t end;
+
+    /* Find the last symbol at or below the PC */
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (symbols[mid].addr <= pc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo > 0) {
+        const struct symbol *sym = &symbols[lo - 1];
+
+        if (sym->size > 0) {
+            end = (uint64_t) sym->addr + sym->size;
+        } else if (lo < symbol_count) {
+            end = symbols[lo].addr;
+        } else {
+            end = (uint64_t) sym->addr + 1;
+        }
+
+        if (pc < end) {
+            return sym->name;
+        }
+    }
+
+    snprintf(buf, len, "0x%08x", pc);
+    return buf;
+}
+
+int
+profile_init(const char *path, const char *map_path,
+             unsigned int rate, enum profile_format format)
+{
+    if (rate == 0 || rate > PROFILE_MAX_RATE) {
+        fprintf(stderr, "Profile rate must be between 1 and %d Hz.\n",
+                PROFILE_MAX_RATE);
+        return -1;
+    }
+
+    if (map_path != NULL && load_map(map_path) < 0) {
+        return -1;
+    }
+
+    out_path = strdup(path);
+    out_format = format;
+    sample_rate = rate;
+    sample_interval = MAX(tuning_steps(1.0) / sample_rate, 1);
+    countdown = sample_interval;
+    samples = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+    profiling = true;
+
+    return 0;
+}
+
+/*
+ * Step the core, stopping every sample_interval steps to take a
+ * sample. The countdown carries over between calls so the sampling
+ * rate is independent of the frame rate. The interval follows the
+ * CPU clock setting, so the rate stays per emulated second.
+ */
+void
+profile_step_loop(size_t steps)
+{
+    while (steps > 0) {
+        size_t slice = MIN(steps, countdown);
+
+        dmd_step_loop(slice);
+
+        steps -= slice;
+        countdown -= slice;
+
+        if (countdown == 0) {
+            profile_sample();
+            sample_interval = MAX(tuning_steps(1.0) / sample_rate, 1);
+            countdown = sample_interval;
+        }
+    }
+}
+
+void
+profile_sample()
+{
+    uint32_t pc = 0;
+    uint32_t psw = 0;
+    gpointer key, count;
+    gint64 k;
+
+    if (dmd_get_pc(&pc) != 0) {
+        return;
+    }
+
+    dmd_get_register(PSW_REGISTER, &psw);
+
+    k = ((gint64)((psw >> PSW_CM_SHIFT) & PSW_CM_MASK) << 32) | pc;
+
+    if (g_hash_table_lookup_extended(samples, &k, &key, &count)) {
+        g_hash_table_insert(samples, key,
+                            GSIZE_TO_POINTER(GPOINTER_TO_SIZE(count) + 1));
+    } else {
+        key = g_new(gint64, 1);
+        *(gint64 *)key = k;
+        g_hash_table_insert(samples, key, GSIZE_TO_POINTER(1));
+    }
+
+    total_samples++;
+}
+
+static int
+entry_compare(const void *a, const void *b)
+{
+    const struct profile_entry *ea = a;
+    const struct profile_entry *eb = b;
+
+    if (ea->count != eb->count) {
+        return ea->count < eb->count ? 1 : -1;
+    }
+
+    return strcmp(ea->key, eb->key);
+}
+
+/*
+ * Write the collected samples. Folded output has one
+ * "mode;function count" line per sampled location, suitable for
+ * flamegraph.pl. The flat report lists functions by sample count.
+ */
+int
+profile_write()
+{
+    GHashTable *totals;
+    GHashTableIter iter;
+    gpointer key, value;
+    struct profile_entry *entries;
+    size_t n = 0;
+    FILE *fp;
+    char buf[32];
+
+    if (!profiling) {
+        return 0;
+    }
+
+    fp = fopen(out_path, "w");
+
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open %s for writing profile.\n", out_path);
+        return -1;
+    }
+
+    /* Aggregate samples by the name they will be reported under */
+    totals = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    g_hash_table_iter_init(&iter, samples);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        gint64 k = *(gint64 *)key;
+        const char *sym = resolve((uint32_t) k, buf, sizeof(buf));
+        char *name;
+        gpointer prev;
+
+        if (out_format == PROFILE_FOLDED) {
+            name = g_strdup_printf("%s;%s", MODE_NAMES[k >> 32], sym);
+        } else {
+            name = g_strdup(sym);
+        }
+
+        prev = g_hash_table_lookup(totals, name);
+        g_hash_table_insert(totals, name,
+                            GSIZE_TO_POINTER(GPOINTER_TO_SIZE(prev) +
+                                             GPOINTER_TO_SIZE(value)));
+    }
+
+    entries = calloc(g_hash_table_size(totals) + 1, sizeof(struct profile_entry));
+
+    g_hash_table_iter_init(&iter, totals);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        entries[n].key = key;
+        entries[n].count = GPOINTER_TO_SIZE(value);
+        n++;
+    }
+
+    qsort(entries, n, sizeof(struct profile_entry), entry_compare);
+
+    if (out_format == PROFILE_FLAT) {
+        fprintf(fp, "%lu samples, %lu steps per sample\n\n",
+                total_samples, sample_interval);
+        fprintf(fp, "%8s %10s  %s\n", "percent", "samples", "function");
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (out_format == PROFILE_FLAT) {
+            fprintf(fp, "%7.2f%% %10lu  %s\n",
+                    100.0 * entries[i].count / total_samples,
+                    entries[i].count,
+                    entries[i].key);
+        } else {
+            fprintf(fp, "%s %lu\n", entries[i].key, entries[i].count);
+        }
+    }
+
+    fclose(fp);
+    free(entries);
+    g_hash_table_destroy(totals);
+
+    return 0;
+}
@@ -0,0 +1,370 @@
+/*
+ * This file is part of the GTK+ DMD 5620 Emultor.
+ *
+ * Copyright 2018, Seth Morabito <web@loomcom.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dmd_5620.h"
+#include "screen_text.h"
+
+/* Open-addressed glyph table; must be a power of two */
+#define GLYPH_TABLE_SIZE  1024
+#define GLYPH_LINE_LEN    128
+
+#define MAX_COLS  (WIDTH / 4)
+#define MAX_ROWS  (HEIGHT / 8)
+
+struct glyph
+{
+    uint64_t hash;
+    char c;
+};
+
+bool screen_text_enabled = false;
+
+static struct text_geometry geometry = {
+    TEXT_CELL_WIDTH, TEXT_CELL_HEIGHT, TEXT_ORIGIN_X, TEXT_ORIGIN_Y
+};
+static int cols = 0;
+static int rows = 0;
+
+static struct glyph glyphs[GLYPH_TABLE_SIZE];
+static size_t glyph_count = 0;
+
+/* Recognized text, and which text rows need to be looked up again */
+static char text[MAX_ROWS][MAX_COLS];
+static uint8_t text_dirty[MAX_ROWS];
+
+/* The hashes of an all-clear and an all-set cell, i.e. blanks */
+static uint64_t blank_hash;
+static uint64_t inverse_blank_hash;
+
+int
+screen_text_parse_geometry(const char *spec, struct text_geometry *geom)
+{
+    struct text_geometry g;
+
+    if (sscanf(spec, "%dx%d+%d+%d", &g.cell_width, &g.cell_height, &g.x, &g.y) != 4 ||
+        g.cell_width < 4 || g.cell_width > TEXT_MAX_CELL ||
+        g.cell_height < 4 || g.cell_height > TEXT_MAX_CELL * 2 ||
+        g.x < 0 || g.x >= WIDTH || g.y < 0 || g.y >= HEIGHT) {
+        fprintf(stderr, "Invalid text cell geometry %s. Expected WxH+X+Y.\n", spec);
+        return -1;
+    }
+
+    *geom = g;
+    return 0;
+}
+
+/*
+ * Hash one cell. Each pixel row of the cell is extracted as an
+ * integer and fed through FNV-1a. "invert" gives the hash of the
+ * same cell in reverse video.
+ */
+static uint64_t
+cell_hash(const uint8_t *vram, int row, int col, bool invert)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    int px = geometry.x + col * geometry.cell_width;
+    int py = geometry.y + row * geometry.cell_height;
+    int byte = px / 8;
+    int shift = 24 - (px % 8) - geometry.cell_width;
+    uint32_t mask = (1 << geometry.cell_width) - 1;
+
+    for (int y = py; y < py + geometry.cell_height; y++) {
+        const uint8_t *line = vram + y * WIDTH_IN_BYTES;
+        uint32_t v = line[byte] << 16;
+        uint32_t bits;
+
+        if (byte + 1 < WIDTH_IN_BYTES) {
+            v |= line[byte + 1] << 8;
+        }
+        if (byte + 2 < WIDTH_IN_BYTES) {
+            v |= line[byte + 2];
+        }
+
+        bits = (v >> shift) & mask;
+        if (invert) {
+            bits ^= mask;
+        }
+
+        hash = (hash ^ (bits & 0xff)) * 1099511628211ULL;
+        hash = (hash ^ (bits >> 8)) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static struct glyph *
+glyph_slot(uint64_t hash)
+{
+    size_t i = hash & (GLYPH_TABLE_SIZE - 1);
+
+    /* Hash 0 marks an empty slot */
+    while (glyphs[i].hash != 0 && glyphs[i].hash != hash) {
+        i = (i + 1) & (GLYPH_TABLE_SIZE - 1);
+    }
+
+    return &glyphs[i];
+}
+
+static int
+glyph_add(uint64_t hash, char c)
+{
+    struct glyph *g;
+
+    if (hash == 0) {
+        return 0;
+    }
+
+    /* Keep the table at most half full */
+    if (glyph_count >= GLYPH_TABLE_SIZE / 2) {
+        return -1;
+    }
+
+    g = glyph_slot(hash);
+
+    if (g->hash == 0) {
+        g->hash = hash;
+        g->c = c;
+        glyph_count++;
+    } else if (g->c != c) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static char
+glyph_lookup(uint64_t hash)
+{
+    struct glyph *g;
+
+    if (hash == blank_hash || hash == inverse_blank_hash) {
+        return ' ';
+    }
+
+    g = glyph_slot(hash);
+
+    return g->hash == hash ? g->c : TEXT_UNKNOWN;
+}
+
+void
+screen_text_init(const struct text_geometry *geom)
+{
+    uint8_t blank[VIDRAM_SIZE];
+
+    geometry = *geom;
+    cols = MIN((WIDTH - geometry.x) / geometry.cell_width, MAX_COLS);
+    rows = MIN((HEIGHT - geometry.y) / geometry.cell_height, MAX_ROWS);
+
+    memset(blank, 0, sizeof(blank));
+    blank_hash = cell_hash(blank, 0, 0, false);
+    inverse_blank_hash = cell_hash(blank, 0, 0, true);
+
+    memset(glyphs, 0, sizeof(glyphs));
+    glyph_count = 0;
+
+    memset(text, ' ', sizeof(text));
+    memset(text_dirty, 1, sizeof(text_dirty));
+}
+
+/*
+ * Load a glyph table written by screen_text_learn. The first line
+ * holds the cell geometry, and each following line a hash and the
+ * character code it stands for.
+ */
+int
+screen_text_load(const char *path)
+{
+    FILE *fp;
+    char line[GLYPH_LINE_LEN];
+    struct text_geometry geom;
+    unsigned long long hash;
+    int c;
+
+    fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open glyph table %s.\n", path);
+        return -1;
+    }
+
+    if (fgets(line, GLYPH_LINE_LEN, fp) == NULL ||
+        sscanf(line, "geometry %d %d %d %d", &geom.cell_width, &geom.cell_height,
+               &geom.x, &geom.y) != 4) {
+        fprintf(stderr, "Glyph table %s does not seem to be valid.\n", path);
+        fclose(fp);
+        return -1;
+    }
+
+    screen_text_init(&geom);
+
+    while (fgets(line, GLYPH_LINE_LEN, fp) != NULL) {
+        if (sscanf(line, "%llx %d", &hash, &c) == 2) {
+            glyph_add(hash, (char) c);
+        }
+    }
+
+    fclose(fp);
+
+    screen_text_enabled = true;
+
+    return 0;
+}
+
+/*
+ * Learn the glyph table from a screen showing the given lines of
+ * text from the top left cell, and write it to "path". Each glyph is
+ * learnt in normal and reverse video.
+ */
+int
+screen_text_learn(const uint8_t *vram, const char *lines[], int count,
+                  const char *path)
+{
+    FILE *fp;
+    int collisions = 0;
+
+    for (int row = 0; row < count && row < rows; row++) {
+        for (int col = 0; lines[row][col] != '\0' && col < cols; col++) {
+            char c = lines[row][col];
+            uint64_t hash = cell_hash(vram, row, col, false);
+
+            if (c == ' ') {
+                continue;
+            }
+
+            if (hash == blank_hash ||
+                glyph_add(hash, c) < 0 ||
+                glyph_add(cell_hash(vram, row, col, true), c) < 0) {
+                collisions++;
+            }
+        }
+    }
+
+    if (collisions > 0) {
+        fprintf(stderr,
+                "%d glyphs could not be told apart; the text cell geometry "
+                "is probably wrong.\n", collisions);
+    }
+
+    fp = fopen(path, "w");
+
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open %s for writing glyph table.\n", path);
+        return -1;
+    }
+
+    fprintf(fp, "geometry %d %d %d %d\n", geometry.cell_width,
+            geometry.cell_height, geometry.x, geometry.y);
+
+    for (int i = 0; i < GLYPH_TABLE_SIZE; i++) {
+        if (glyphs[i].hash != 0) {
+            fprintf(fp, "%016llx %d\n", (unsigned long long) glyphs[i].hash,
+                    glyphs[i].c);
+        }
+    }
+
+    fclose(fp);
+
+    printf("Learnt %lu glyph hashes into %s\n", glyph_count, path);
+
+    return collisions > 0 ? -1 : 0;
+}
+
+/*
+ * Note that pixel row y changed, so the text row holding it must be
+ * looked up again.
+ */
+void
+screen_text_mark_row(int y)
+{
+    int row = (y - geometry.y) / geometry.cell_height;
+
+    if (y >= geometry.y && row < rows) {
+        text_dirty[row] = 1;
+    }
+}
+
+void
+screen_text_update(const uint8_t *vram)
+{
+    for (int row = 0; row < rows; row++) {
+        if (!text_dirty[row]) {
+            continue;
+        }
+
+        for (int col = 0; col < cols; col++) {
+            text[row][col] = glyph_lookup(cell_hash(vram, row, col, false));
+        }
+
+        text_dirty[row] = 0;
+    }
+}
+
+bool
+screen_text_find(const char *needle)
+{
+    size_t len = strlen(needle);
+
+    if (len == 0 || len > (size_t) cols) {
+        return len == 0;
+    }
+
+    for (int row = 0; row < rows; row++) {
+        for (int col = 0; col + len <= (size_t) cols; col++) {
+            if (memcmp(&text[row][col], needle, len) == 0) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Return the screen as text, one line per row, without trailing
+ * blanks. The caller frees the result with g_free().
+ */
+char *
+screen_text_dump()
+{
+    GString *out = g_string_sized_new(rows * (cols + 1));
+
+    for (int row = 0; row < rows; row++) {
+        int len = cols;
+
+        while (len > 0 && text[row][len - 1] == ' ') {
+            len--;
+        }
+
+        g_string_append_len(out, text[row], len);
+        g_string_append_c(out, '\n');
+    }
+
+    return g_string_free(out, FALSE);
+}
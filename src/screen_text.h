@@ -0,0 +1,69 @@
+/*
+ * This file is part of the GTK+ DMD 5620 Emultor.
+ *
+ * Copyright 2018, Seth Morabito <web@loomcom.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __SCREEN_TEXT_H__
+#define __SCREEN_TEXT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Screen text recognition. The screen is divided into character
+ * cells, and each cell's bitmap is hashed and looked up in a table of
+ * glyph hashes learnt from the firmware's own font. Only cells on
+ * rows that changed are looked up again.
+ */
+
+/* Default cell geometry of the firmware's terminal font */
+#define TEXT_CELL_WIDTH   9
+#define TEXT_CELL_HEIGHT  14
+#define TEXT_ORIGIN_X     6
+#define TEXT_ORIGIN_Y     8
+
+#define TEXT_MAX_CELL     16
+#define TEXT_UNKNOWN      '?'
+
+struct text_geometry
+{
+    int cell_width;
+    int cell_height;
+    int x;
+    int y;
+};
+
+extern bool screen_text_enabled;
+
+int screen_text_parse_geometry(const char *spec, struct text_geometry *geom);
+void screen_text_init(const struct text_geometry *geom);
+int screen_text_load(const char *path);
+int screen_text_learn(const uint8_t *vram, const char *lines[], int count,
+                      const char *path);
+void screen_text_mark_row(int y);
+void screen_text_update(const uint8_t *vram);
+bool screen_text_find(const char *needle);
+char *screen_text_dump();
+
+#endif
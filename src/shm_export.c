@@ -0,0 +1,177 @@
+/*
+ * This file is part of the GTK+ DMD 5620 Emultor.
+ *
+ * Copyright 2018, Seth Morabito <web@loomcom.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#if defined __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "dmd_shm.h"
+#include "shm_export.h"
+
+bool shm_exporting = false;
+
+static struct dmd_shm *shm = NULL;
+static char *shm_name = NULL;
+
+int
+shm_export_init(const char *name)
+{
+    int fd;
+
+    /* POSIX shared memory names must start with a slash */
+    if (name[0] == '/') {
+        shm_name = strdup(name);
+    } else {
+        shm_name = malloc(strlen(name) + 2);
+        sprintf(shm_name, "/%s", name);
+    }
+
+    /* A segment left behind by an earlier run that crashed can be
+     * removed, but only if it is ours. Anything that is still there
+     * afterwards belongs to someone else, and is not trusted. */
+    if (shm_unlink(shm_name) < 0 && errno != ENOENT) {
+        fprintf(stderr, "error %d removing stale shared memory %s: %s\n",
+                errno, shm_name, strerror(errno));
+        return -1;
+    }
+
+    fd = shm_open(shm_name, O_CREAT|O_EXCL|O_RDWR, 0600);
+
+    if (fd < 0) {
+        fprintf(stderr, "error %d creating shared memory %s: %s\n",
+                errno, shm_name, strerror(errno));
+        return -1;
+    }
+
+    if (ftruncate(fd, sizeof(struct dmd_shm)) < 0) {
+        fprintf(stderr, "error %d sizing shared memory %s: %s\n",
+                errno, shm_name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    shm = mmap(NULL, sizeof(struct dmd_shm), PROT_READ|PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (shm == MAP_FAILED) {
+        fprintf(stderr, "error %d mapping shared memory %s: %s\n",
+                errno, shm_name, strerror(errno));
+        shm = NULL;
+        return -1;
+    }
+
+    memset(shm, 0, sizeof(struct dmd_shm));
+    shm->width = DMD_SHM_WIDTH;
+    shm->height = DMD_SHM_HEIGHT;
+    shm->stride = DMD_SHM_STRIDE;
+    shm->version = DMD_SHM_VERSION;
+    __atomic_store_n(&shm->magic, DMD_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    shm_exporting = true;
+
+    return 0;
+}
+
+/*
+ * Publish a frame. "vram" is NULL if video memory has not been
+ * written since the last call. Only rows that differ from the copy already in the
+ * segment are written, so the cost of an unchanged or mostly
+ * unchanged screen is a compare, and readers get an exact dirty map.
+ */
+void
+shm_export_publish(const uint8_t *vram, uint8_t oport)
+{
+    uint32_t palette = (oport & 0x2) ? 1 : 0;
+    bool changed = (palette != shm->palette);
+    uint8_t rows[DMD_SHM_HEIGHT / 8];
+
+    if (vram == NULL && !changed) {
+        return;
+    }
+
+    memset(rows, 0, sizeof(rows));
+
+    if (vram != NULL) {
+        for (int y = 0; y < DMD_SHM_HEIGHT; y++) {
+            size_t offset = y * DMD_SHM_STRIDE;
+            if (memcmp(shm->vram + offset, vram + offset, DMD_SHM_STRIDE) != 0) {
+                rows[y / 8] |= 1 << (y % 8);
+                changed = true;
+            }
+        }
+    }
+
+    if (!changed) {
+        return;
+    }
+
+    /* Odd sequence: frame in progress. The fence keeps the row
+     * stores below from becoming visible before the odd value. */
+    __atomic_fetch_add(&shm->seq, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    for (int y = 0; y < DMD_SHM_HEIGHT; y++) {
+        if (rows[y / 8] & (1 << (y % 8))) {
+            size_t offset = y * DMD_SHM_STRIDE;
+            memcpy(shm->vram + offset, vram + offset, DMD_SHM_STRIDE);
+        }
+    }
+
+    memcpy(shm->dirty, rows, sizeof(rows));
+    shm->palette = palette;
+    shm->frame++;
+
+    /* Even sequence: frame complete */
+    __atomic_fetch_add(&shm->seq, 1, __ATOMIC_RELEASE);
+
+#if defined __linux__
+    syscall(SYS_futex, &shm->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+void
+shm_export_close()
+{
+    if (shm != NULL) {
+        munmap(shm, sizeof(struct dmd_shm));
+        shm_unlink(shm_name);
+        shm = NULL;
+    }
+
+    shm_exporting = false;
+}
@@ -0,0 +1,274 @@
+/*
+ * This file is part of the GTK+ DMD 5620 Emultor.
+ *
+ * Copyright 2018, Seth Morabito <web@loomcom.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tee.h"
+
+/* Coarse clocks are read without a system call, and milliseconds are
+ * all the log needs */
+#ifdef CLOCK_MONOTONIC_COARSE
+#define TEE_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define TEE_CLOCK CLOCK_MONOTONIC
+#endif
+
+struct tee_header
+{
+    uint32_t time_ms;
+    uint16_t len;
+    uint8_t dir;
+    uint8_t reserved;
+};
+
+bool teeing = false;
+
+/* Single producer (the emulator thread), single consumer (the writer
+ * thread). Positions only ever increase; the ring index is the
+ * position modulo TEE_BUF_SIZE. */
+static uint8_t *ring = NULL;
+static uint64_t head = 0;
+static uint64_t tail = 0;
+static uint64_t lost = 0;
+
+static FILE *tee_file = NULL;
+static pthread_t writer_thread;
+static bool stopping = false;
+static struct timespec start_time;
+
+static uint32_t
+elapsed_ms()
+{
+    struct timespec now;
+
+    clock_gettime(TEE_CLOCK, &now);
+
+    return (uint32_t)((now.tv_sec - start_time.tv_sec) * 1000 +
+                      (now.tv_nsec - start_time.tv_nsec) / 1000000);
+}
+
+static void
+ring_put(uint64_t pos, const void *src, size_t len)
+{
+    size_t at = pos % TEE_BUF_SIZE;
+    size_t first = TEE_BUF_SIZE - at < len ? TEE_BUF_SIZE - at : len;
+
+    memcpy(ring + at, src, first);
+    memcpy(ring, (const uint8_t *) src + first, len - first);
+}
+
+static void
+ring_get(uint64_t pos, void *dst, size_t len)
+{
+    size_t at = pos % TEE_BUF_SIZE;
+    size_t first = TEE_BUF_SIZE - at < len ? TEE_BUF_SIZE - at : len;
+
+    memcpy(dst, ring + at, first);
+    memcpy((uint8_t *) dst + first, ring, len - first);
+}
+
+/*
+ * Copy a chunk of serial traffic into the ring. Never blocks.
+ */
+void
+tee_record(enum tee_direction dir, const uint8_t *buf, size_t len)
+{
+    struct tee_header hdr;
+    uint64_t free_space;
+
+    if (!teeing || len == 0) {
+        return;
+    }
+
+    while (len > 0) {
+        size_t chunk = len > UINT16_MAX ? UINT16_MAX : len;
+
+        free_space = TEE_BUF_SIZE - (head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE));
+
+        if (free_space < sizeof(hdr) + chunk) {
+            __atomic_fetch_add(&lost, len, __ATOMIC_RELAXED);
+            return;
+        }
+
+        hdr.time_ms = elapsed_ms();
+        hdr.len = (uint16_t) chunk;
+        hdr.dir = (uint8_t) dir;
+        hdr.reserved = 0;
+
+        ring_put(head, &hdr, sizeof(hdr));
+        ring_put(head + sizeof(hdr), buf, chunk);
+        __atomic_store_n(&head, head + sizeof(hdr) + chunk, __ATOMIC_RELEASE);
+
+        buf += chunk;
+        len -= chunk;
+    }
+}
+
+/*
+ * Write one record as a line: time, direction ('<' from the host,
+ * '>' to the host), and the bytes as an escaped string.
+ */
+static void
+write_record(const struct tee_header *hdr, const uint8_t *data)
+{
+    fprintf(tee_file, "%6u.%03u %c \"", hdr->time_ms / 1000, hdr->time_ms % 1000,
+            hdr->dir == TEE_FROM_HOST ? '<' : '>');
+
+    for (size_t i = 0; i < hdr->len; i++) {
+        uint8_t c = data[i];
+
+        switch (c) {
+        case '\r':
+            fputs("\\r", tee_file);
+            break;
+        case '\n':
+            fputs("\\n", tee_file);
+            break;
+        case '\t':
+            fputs("\\t", tee_file);
+            break;
+        case '\\':
+        case '"':
+            fputc('\\', tee_file);
+            fputc(c, tee_file);
+            break;
+        default:
+            if (c >= 0x20 && c < 0x7f) {
+                fputc(c, tee_file);
+            } else {
+                fprintf(tee_file, "\\x%02x", c);
+            }
+            break;
+        }
+    }
+
+    fputs("\"\n", tee_file);
+}
+
+static void
+drain()
+{
+    uint8_t data[UINT16_MAX];
+    struct tee_header hdr;
+    uint64_t end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    uint64_t pos = tail;
+    uint64_t dropped;
+
+    while (pos < end) {
+        ring_get(pos, &hdr, sizeof(hdr));
+        ring_get(pos + sizeof(hdr), data, hdr.len);
+        pos += sizeof(hdr) + hdr.len;
+        write_record(&hdr, data);
+    }
+
+    __atomic_store_n(&tail, pos, __ATOMIC_RELEASE);
+
+    dropped = __atomic_exchange_n(&lost, 0, __ATOMIC_RELAXED);
+    if (dropped > 0) {
+        fprintf(tee_file, "%6u.%03u ! %lu bytes not logged, the log could not keep up\n",
+                elapsed_ms() / 1000, elapsed_ms() % 1000, (unsigned long) dropped);
+    }
+
+    fflush(tee_file);
+}
+
+static void *
+tee_writer(void *arg)
+{
+    struct timespec delay = { 0, TEE_FLUSH_MS * 1000000L };
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        nanosleep(&delay, NULL);
+        drain();
+    }
+
+    return NULL;
+}
+
+/*
+ * Start logging serial traffic to path.
+ */
+int
+tee_init(const char *path)
+{
+    tee_file = fopen(path, "w");
+
+    if (tee_file == NULL) {
+        fprintf(stderr, "Could not open %s for writing: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    ring = malloc(TEE_BUF_SIZE);
+
+    if (ring == NULL) {
+        fprintf(stderr, "Could not allocate the serial log buffer.\n");
+        fclose(tee_file);
+        tee_file = NULL;
+        return -1;
+    }
+
+    clock_gettime(TEE_CLOCK, &start_time);
+
+    if (pthread_create(&writer_thread, NULL, tee_writer, NULL) != 0) {
+        fprintf(stderr, "Could not start the serial log writer.\n");
+        free(ring);
+        ring = NULL;
+        fclose(tee_file);
+        tee_file = NULL;
+        return -1;
+    }
+
+    teeing = true;
+
+    return 0;
+}
+
+/*
+ * Stop the writer and write out whatever is left.
+ */
+void
+tee_close()
+{
+    if (!teeing) {
+        return;
+    }
+
+    teeing = false;
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+    pthread_join(writer_thread, NULL);
+
+    drain();
+    fclose(tee_file);
+    tee_file = NULL;
+
+    free(ring);
+    ring = NULL;
+}
@@ -0,0 +1,57 @@
+/*
+ * This file is part of the GTK+ DMD 5620 Emultor.
+ *
+ * Copyright 2018, Seth Morabito <web@loomcom.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __TEE_H__
+#define __TEE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Serial traffic log. Both directions of the host connection are
+ * copied, with a direction marker and a millisecond timestamp, into a
+ * large in-memory ring. A background thread formats the ring and
+ * writes it to the log file, so the emulator never waits on the disk.
+ * If the writer falls behind and the ring fills, traffic is left out
+ * of the log (never held up) and the loss is counted.
+ */
+
+#define TEE_BUF_SIZE   (4 * 1024 * 1024)
+#define TEE_FLUSH_MS   100
+
+enum tee_direction {
+    TEE_FROM_HOST,
+    TEE_TO_HOST
+};
+
+extern bool teeing;
+
+int tee_init(const char *path);
+void tee_record(enum tee_direction dir, const uint8_t *buf, size_t len);
+void tee_close();
+
+#endif
@@ -0,0 +1,221 @@
+/*
+ * This file is part of the GTK+ DMD 5620 Emultor.
+ *
+ * Copyright 2018, Seth Morabito <web@loomcom.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_PATH_LEN 256
+
+struct trace_ring
+{
+    uint32_t tid;
+    uint64_t head;
+    struct trace_record records[TRACE_RING_SIZE];
+};
+
+static struct trace_ring *rings[TRACE_MAX_THREADS];
+static uint32_t ring_count = 0;
+static __thread struct trace_ring *ring = NULL;
+static __thread bool untraced = false;
+
+static char trace_path[TRACE_PATH_LEN];
+
+/*
+ * Give the calling thread its ring. Threads beyond TRACE_MAX_THREADS
+ * are not traced.
+ */
+static struct trace_ring *
+ring_register()
+{
+    uint32_t slot = __atomic_fetch_add(&ring_count, 1, __ATOMIC_RELAXED);
+    struct trace_ring *r;
+
+    if (slot >= TRACE_MAX_THREADS) {
+        return NULL;
+    }
+
+    r = calloc(1, sizeof(struct trace_ring));
+
+    if (r != NULL) {
+        r->tid = slot + 1;
+        __atomic_store_n(&rings[slot], r, __ATOMIC_RELEASE);
+    }
+
+    return r;
+}
+
+void
+trace(enum trace_type type, uint32_t arg)
+{
+    struct trace_ring *r = ring;
+    struct trace_record *rec;
+    struct timespec ts;
+    uint64_t head;
+
+    if (r == NULL) {
+        if (untraced) {
+            return;
+        }
+        r = ring = ring_register();
+        if (r == NULL) {
+            untraced = true;
+            return;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    /* Only the owning thread writes, so publishing the new head
+     * after the record is enough for a reader to see it complete. */
+    head = r->head;
+    rec = &r->records[head & (TRACE_RING_SIZE - 1)];
+    rec->time_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    rec->type = type;
+    rec->arg = arg;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void
+write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) {
+            return;
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+/*
+ * Write all rings to the trace file. This only uses async-signal-safe
+ * calls, so it may run directly in the SIGUSR1 handler.
+ */
+int
+trace_dump()
+{
+    struct trace_file_header header;
+    uint32_t count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    int fd;
+
+    if (trace_path[0] == '\0') {
+        return -1;
+    }
+
+    /* Never follow a symlink planted at the trace path */
+    fd = open(trace_path, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, 0644);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (count > TRACE_MAX_THREADS) {
+        count = TRACE_MAX_THREADS;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.rings = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (__atomic_load_n(&rings[i], __ATOMIC_ACQUIRE) != NULL) {
+            header.rings++;
+        }
+    }
+
+    write_all(fd, &header, sizeof(header));
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct trace_ring *r = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+        struct trace_ring_header rh;
+        uint64_t head, first;
+
+        if (r == NULL) {
+            continue;
+        }
+
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+        rh.tid = r->tid;
+        rh.count = (uint32_t)(head - first);
+        write_all(fd, &rh, sizeof(rh));
+
+        /* Oldest first: the tail of the buffer, then the head */
+        if (head > TRACE_RING_SIZE) {
+            size_t split = head & (TRACE_RING_SIZE - 1);
+            write_all(fd, &r->records[split],
+                      (TRACE_RING_SIZE - split) * sizeof(struct trace_record));
+            write_all(fd, r->records, split * sizeof(struct trace_record));
+        } else {
+            write_all(fd, r->records, head * sizeof(struct trace_record));
+        }
+    }
+
+    close(fd);
+
+    return 0;
+}
+
+static void
+trace_signal_handler(int signal)
+{
+    trace_dump();
+}
+
+/*
+ * Set the file the trace is dumped to, and dump it on SIGUSR1. The
+ * default is in the user's private runtime directory, or failing that
+ * the working directory, rather than a guessable name in /tmp.
+ */
+void
+trace_init(const char *path)
+{
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+
+    if (path != NULL) {
+        strncpy(trace_path, path, TRACE_PATH_LEN - 1);
+    } else if (dir != NULL && dir[0] != '\0') {
+        snprintf(trace_path, TRACE_PATH_LEN, "%s/dmd5620-%d.trace", dir, (int) getpid());
+    } else {
+        snprintf(trace_path, TRACE_PATH_LEN, "dmd5620-%d.trace", (int) getpid());
+    }
+
+    signal(SIGUSR1, trace_signal_handler);
+}
@@ -0,0 +1,88 @@
+/*
+ * This file is part of the GTK+ DMD 5620 Emultor.
+ *
+ * Copyright 2018, Seth Morabito <web@loomcom.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+/*
+ * Binary trace of hot-path events. Each thread records into its own
+ * fixed-size ring, with no locks and no system calls other than
+ * reading the clock, so tracing is always on. The rings are written
+ * to a file on SIGUSR1, and at exit when --trace is given. The file
+ * format is described below; tools/dmd_trace2json converts it to
+ * Chrome trace-event JSON.
+ *
+ * File layout (native byte order):
+ *   struct trace_file_header
+ *   for each ring: struct trace_ring_header, then "count" records,
+ *   oldest first.
+ */
+
+#define TRACE_MAGIC       "DMDTRACE"
+#define TRACE_VERSION     1
+#define TRACE_RING_SIZE   65536
+#define TRACE_MAX_THREADS 8
+
+enum trace_type {
+    TRACE_TICK_BEGIN = 1,
+    TRACE_TICK_END,
+    TRACE_STEPS,        /* arg: steps run */
+    TRACE_RX_BATCH,     /* arg: bytes received from the host */
+    TRACE_TX_BATCH,     /* arg: bytes sent to the host */
+    TRACE_VRAM_DIRTY,   /* arg: rows changed */
+    TRACE_KEY,          /* arg: key code sent to the terminal */
+    TRACE_MOUSE,        /* arg: 0 for motion, otherwise button + 1 */
+    TRACE_BURST         /* arg: steps run early for input */
+};
+
+struct trace_record
+{
+    uint64_t time_ns;
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t arg;
+};
+
+struct trace_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t rings;
+};
+
+struct trace_ring_header
+{
+    uint32_t tid;
+    uint32_t count;
+};
+
+void trace(enum trace_type type, uint32_t arg);
+void trace_init(const char *path);
+int trace_dump();
+
+#endif
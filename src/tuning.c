@@ -0,0 +1,244 @@
+/*
+ * This file is part of the GTK+ DMD 5620 Emultor.
+ *
+ * Copyright 2018, Seth Morabito <web@loomcom.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "tuning.h"
+
+struct tuning tuning = {
+    7.2,            /* The WE 32100 in the 5620 runs at 7.2 MHz */
+    350000,
+    64,
+    100,
+    0,
+    RENDER_ROWS
+};
+
+static const char *RENDER_NAMES[] = { "rows", "full" };
+
+const char *
+tuning_render_name(enum render_mode mode)
+{
+    return RENDER_NAMES[mode];
+}
+
+/*
+ * Keep every setting within the range the emulator can work with.
+ */
+void
+tuning_clamp()
+{
+    tuning.cpu_mhz = CLAMP(tuning.cpu_mhz, 0.1, 1000.0);
+    tuning.max_steps = CLAMP(tuning.max_steps, 1000, 100000000);
+    tuning.buf_len = CLAMP(tuning.buf_len, 1, TUNING_BUF_MAX);
+    tuning.tty_poll_ms = CLAMP(tuning.tty_poll_ms, 0, 1000);
+    tuning.frame_cap = MIN(tuning.frame_cap, 1000);
+}
+
+/*
+ * The number of CPU steps in the given span of emulated time at the
+ * current clock rate.
+ */
+size_t
+tuning_steps(double seconds)
+{
+    return (size_t)(tuning.cpu_mhz * 1e6 * seconds);
+}
+
+/*
+ * The config file in the user's configuration directory. Free with
+ * g_free().
+ */
+char *
+tuning_default_path()
+{
+    return g_build_filename(g_get_user_config_dir(), "dmd5620", TUNING_FILE, NULL);
+}
+
+/*
+ * Report a setting that could not be used. In a file the user asked
+ * for this is an error; in the default file it is only a warning, and
+ * the setting keeps its default.
+ */
+static int
+config_problem(const char *path, const char *key, const char *message, bool strict)
+{
+    fprintf(stderr, "%s %s in config file %s: %s\n",
+            strict ? "Bad" : "Ignoring bad", key, path, message);
+
+    return strict ? -1 : 0;
+}
+
+static int
+load_double(GKeyFile *kf, const char *path, const char *key, double *value, bool strict)
+{
+    GError *err = NULL;
+    double v;
+    int result = 0;
+
+    if (!g_key_file_has_key(kf, TUNING_GROUP, key, NULL)) {
+        return 0;
+    }
+
+    v = g_key_file_get_double(kf, TUNING_GROUP, key, &err);
+
+    if (err != NULL) {
+        result = config_problem(path, key, err->message, strict);
+        g_error_free(err);
+    } else if (v <= 0) {
+        result = config_problem(path, key, "must be greater than zero", strict);
+    } else {
+        *value = v;
+    }
+
+    return result;
+}
+
+static int
+load_integer(GKeyFile *kf, const char *path, const char *key, gint64 *value, bool strict)
+{
+    GError *err = NULL;
+    gint64 v;
+    int result = 0;
+
+    if (!g_key_file_has_key(kf, TUNING_GROUP, key, NULL)) {
+        return 0;
+    }
+
+    v = g_key_file_get_int64(kf, TUNING_GROUP, key, &err);
+
+    if (err != NULL) {
+        result = config_problem(path, key, err->message, strict);
+        g_error_free(err);
+    } else if (v < 0) {
+        result = config_problem(path, key, "must not be negative", strict);
+    } else {
+        *value = v;
+    }
+
+    return result;
+}
+
+/*
+ * Read settings from a config file. A missing file, or missing keys,
+ * leave the defaults in place. If "strict" is false, as it is for the
+ * default file, a file that can't be read or a bad setting is warned
+ * about and otherwise ignored, so it can't stop the emulator starting.
+ */
+int
+tuning_load(const char *path, bool strict)
+{
+    GKeyFile *kf;
+    GError *err = NULL;
+    gint64 max_steps = tuning.max_steps;
+    gint64 buf_len = tuning.buf_len;
+    gint64 tty_poll_ms = tuning.tty_poll_ms;
+    gint64 frame_cap = tuning.frame_cap;
+    char *render;
+    int result = 0;
+
+    if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+        return 0;
+    }
+
+    kf = g_key_file_new();
+
+    if (!g_key_file_load_from_file(kf, path, G_KEY_FILE_NONE, &err)) {
+        fprintf(stderr, "Could not read config file %s: %s\n", path, err->message);
+        g_error_free(err);
+        g_key_file_free(kf);
+        return strict ? -1 : 0;
+    }
+
+    result |= load_double(kf, path, "cpu_mhz", &tuning.cpu_mhz, strict);
+    result |= load_integer(kf, path, "max_steps", &max_steps, strict);
+    result |= load_integer(kf, path, "buf_len", &buf_len, strict);
+    result |= load_integer(kf, path, "tty_poll_ms", &tty_poll_ms, strict);
+    result |= load_integer(kf, path, "frame_cap", &frame_cap, strict);
+
+    tuning.max_steps = (size_t) max_steps;
+    tuning.buf_len = (size_t) buf_len;
+    tuning.tty_poll_ms = (int) MIN(tty_poll_ms, G_MAXINT);
+    tuning.frame_cap = (unsigned int) MIN(frame_cap, G_MAXUINT);
+
+    render = g_key_file_get_string(kf, TUNING_GROUP, "render_mode", NULL);
+    if (render != NULL) {
+        if (strcmp(render, RENDER_NAMES[RENDER_FULL]) == 0) {
+            tuning.render_mode = RENDER_FULL;
+        } else if (strcmp(render, RENDER_NAMES[RENDER_ROWS]) == 0) {
+            tuning.render_mode = RENDER_ROWS;
+        } else {
+            result |= config_problem(path, "render_mode",
+                                     "must be \"rows\" or \"full\"", strict);
+        }
+        g_free(render);
+    }
+
+    g_key_file_free(kf);
+    tuning_clamp();
+
+    return result;
+}
+
+/*
+ * Write the current settings to a config file, keeping anything else
+ * that was already in it.
+ */
+int
+tuning_save(const char *path)
+{
+    GKeyFile *kf = g_key_file_new();
+    GError *err = NULL;
+    char *dir;
+    int result = 0;
+
+    g_key_file_load_from_file(kf, path, G_KEY_FILE_KEEP_COMMENTS, NULL);
+
+    g_key_file_set_double(kf, TUNING_GROUP, "cpu_mhz", tuning.cpu_mhz);
+    g_key_file_set_uint64(kf, TUNING_GROUP, "max_steps", tuning.max_steps);
+    g_key_file_set_uint64(kf, TUNING_GROUP, "buf_len", tuning.buf_len);
+    g_key_file_set_integer(kf, TUNING_GROUP, "tty_poll_ms", tuning.tty_poll_ms);
+    g_key_file_set_integer(kf, TUNING_GROUP, "frame_cap", (gint) tuning.frame_cap);
+    g_key_file_set_string(kf, TUNING_GROUP, "render_mode", RENDER_NAMES[tuning.render_mode]);
+
+    dir = g_path_get_dirname(path);
+    g_mkdir_with_parents(dir, 0755);
+    g_free(dir);
+
+    if (!g_key_file_save_to_file(kf, path, &err)) {
+        fprintf(stderr, "Could not write config file %s: %s\n", path, err->message);
+        g_error_free(err);
+        result = -1;
+    }
+
+    g_key_file_free(kf);
+
+    return result;
+}
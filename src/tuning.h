@@ -0,0 +1,66 @@
+/*
+ * This file is part of the GTK+ DMD 5620 Emultor.
+ *
+ * Copyright 2018, Seth Morabito <web@loomcom.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __TUNING_H__
+#define __TUNING_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Performance settings that can be changed while the terminal runs,
+ * from the Performance dialog, and kept in a config file.
+ */
+
+#define TUNING_GROUP     "performance"
+#define TUNING_FILE      "dmd5620.conf"
+#define TUNING_BUF_MAX  4096
+
+enum render_mode {
+    RENDER_ROWS,    /* Convert only the rows that changed */
+    RENDER_FULL     /* Convert the whole frame whenever it changes */
+};
+
+struct tuning
+{
+    double cpu_mhz;             /* Emulated CPU clock */
+    size_t max_steps;           /* Most CPU steps run in one tick */
+    size_t buf_len;             /* Serial I/O buffer size */
+    int tty_poll_ms;            /* Serial device poll timeout */
+    unsigned int frame_cap;     /* Most frames converted a second, 0 for no limit */
+    enum render_mode render_mode;
+};
+
+extern struct tuning tuning;
+
+char *tuning_default_path();
+int tuning_load(const char *path, bool strict);
+int tuning_save(const char *path);
+void tuning_clamp();
+size_t tuning_steps(double seconds);
+const char *tuning_render_name(enum render_mode mode);
+
+#endif
@@ -0,0 +1,497 @@
+/*
+ * This file is part of the GTK+ DMD 5620 Emultor.
+ *
+ * Copyright 2018, Seth Morabito <web@loomcom.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Serial soak test generator. "make soak" runs this as the shell of a
+ * headless emulator, so its standard input and output are the slave
+ * side of the emulator's PTY.
+ *
+ * It streams numbered lines of patterned text at full speed, and after
+ * every PROBE_INTERVAL lines sends a Primary Device Attributes request
+ * (ESC [ c). The firmware answers each request with ESC [ ? ... c
+ * through its DUART transmitter, so every answer has made the full
+ * round trip: PTY, dmd_rs232_rx, the firmware, dmd_rs232_tx and back.
+ * A request or answer that goes missing, or comes back garbled, shows
+ * that bytes were lost along the way.
+ *
+ * The probes alone would miss a byte lost from the text between them.
+ * At the end a last probe is sent, and its answer means the firmware
+ * has handled everything before it. Two more checks follow:
+ *
+ * - The generator asks the emulator's --metrics socket how many bytes
+ *   it read from the PTY, and compares that with how many it wrote.
+ *   This only covers the PTY, before the bytes reach the DUART.
+ *
+ * - "dmd_soak --check SCREEN" is run after the emulator has exited,
+ *   on the screen text it wrote with --dump-text. The bottom of the
+ *   screen must hold the last numbered lines sent, each exactly as
+ *   sent. These bytes went through the DUART and the firmware, but
+ *   only the final screenful can be checked this way.
+ *
+ * Environment:
+ *   DMD_SOAK_SECONDS  how long to stream for (default 30)
+ *   DMD_SOAK_REPORT   where to write the report (default soak-report.txt)
+ *   DMD_SOAK_METRICS  the emulator's --metrics socket (default: no byte count check)
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define PROBE_INTERVAL    16
+#define MAX_OUTSTANDING   8
+#define MAX_PROBES        1000000
+#define PROBE_TIMEOUT_US  5000000
+#define WARMUP_US         60000000
+#define LINE_LEN          128
+#define RESPONSE_LEN      32
+#define METRICS_LEN       16384
+#define SCREEN_ROWS       128
+#define SCREEN_MIN_LINES  48
+
+static const char PROBE[] = "\033[c";
+
+static uint64_t probe_sent[MAX_OUTSTANDING];
+static int probe_head = 0;
+static int probe_count = 0;
+
+static uint32_t latencies[MAX_PROBES];
+static size_t answered = 0;
+static size_t probes = 0;
+static size_t lost = 0;
+static size_t garbled = 0;
+static uint64_t bytes_sent = 0;
+static uint64_t bytes_total = 0;
+static int64_t bytes_received = -1;
+static int64_t last_line = -1;
+
+static char response[RESPONSE_LEN];
+static size_t response_len = 0;
+static bool in_response = false;
+
+static uint64_t
+now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+format_line(char *buf, size_t len, uint32_t seq)
+{
+    return snprintf(buf, len,
+                    "SOAK %08u ABCDEFGHIJKLMNOPQRSTUVWXYZ abcdefghijklmnopqrstuvwxyz 0123456789",
+                    seq);
+}
+
+static int
+compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static bool
+write_all(const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                struct pollfd pfd = { STDOUT_FILENO, POLLOUT, 0 };
+                poll(&pfd, 1, 100);
+                continue;
+            }
+            return false;
+        }
+
+        buf += n;
+        len -= n;
+        bytes_sent += n;
+        bytes_total += n;
+    }
+
+    return true;
+}
+
+static void
+send_probe()
+{
+    if (!write_all(PROBE, sizeof(PROBE) - 1)) {
+        return;
+    }
+
+    probe_sent[(probe_head + probe_count) % MAX_OUTSTANDING] = now_us();
+    probe_count++;
+    probes++;
+}
+
+static void
+answer_probe(bool ok)
+{
+    uint64_t latency;
+
+    if (probe_count == 0) {
+        /* An answer nobody asked for */
+        garbled++;
+        return;
+    }
+
+    latency = now_us() - probe_sent[probe_head];
+    probe_head = (probe_head + 1) % MAX_OUTSTANDING;
+    probe_count--;
+
+    if (!ok) {
+        garbled++;
+    } else if (answered < MAX_PROBES) {
+        latencies[answered++] = (uint32_t) latency;
+    }
+}
+
+static void
+expire_probes()
+{
+    uint64_t now = now_us();
+
+    while (probe_count > 0 && now - probe_sent[probe_head] > PROBE_TIMEOUT_US) {
+        probe_head = (probe_head + 1) % MAX_OUTSTANDING;
+        probe_count--;
+        lost++;
+    }
+}
+
+/*
+ * Scan what the terminal sent back for ESC [ ? ... c answers.
+ */
+static void
+read_responses(int timeout_ms)
+{
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    char buf[256];
+    ssize_t n;
+
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return;
+    }
+
+    n = read(STDIN_FILENO, buf, sizeof(buf));
+
+    for (ssize_t i = 0; i < n; i++) {
+        char c = buf[i];
+
+        if (c == '\033') {
+            if (in_response) {
+                answer_probe(false);
+            }
+            in_response = true;
+            response_len = 0;
+            continue;
+        }
+
+        if (!in_response) {
+            continue;
+        }
+
+        if (response_len < RESPONSE_LEN - 1) {
+            response[response_len++] = c;
+        }
+
+        if (c == 'c') {
+            response[response_len] = '\0';
+            answer_probe(response[0] == '[' && response[1] == '?');
+            in_response = false;
+        }
+    }
+}
+
+/*
+ * Read dmd_rs232_rx_bytes_total from the emulator's metrics socket.
+ * Returns -1 if it can't be had.
+ */
+static int64_t
+fetch_received(const char *path)
+{
+    static const char REQUEST[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    static const char NAME[] = "\ndmd_rs232_rx_bytes_total ";
+    struct sockaddr_un addr;
+    char buf[METRICS_LEN];
+    size_t len = 0;
+    ssize_t n;
+    char *p;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        write(fd, REQUEST, sizeof(REQUEST) - 1) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    while (len < sizeof(buf) - 1 && (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+        len += n;
+    }
+    buf[len] = '\0';
+    close(fd);
+
+    p = strstr(buf, NAME);
+    if (p == NULL) {
+        return -1;
+    }
+
+    return (int64_t) strtoull(p + sizeof(NAME) - 1, NULL, 10);
+}
+
+static bool
+passed()
+{
+    return lost == 0 && garbled == 0 && answered > 0 &&
+        (getenv("DMD_SOAK_METRICS") == NULL || bytes_received == (int64_t) bytes_total);
+}
+
+static void
+set_raw()
+{
+    struct termios tty;
+
+    if (tcgetattr(STDIN_FILENO, &tty) == 0) {
+        cfmakeraw(&tty);
+        tcsetattr(STDIN_FILENO, TCSANOW, &tty);
+    }
+
+    fcntl(STDOUT_FILENO, F_SETFL, fcntl(STDOUT_FILENO, F_GETFL) | O_NONBLOCK);
+}
+
+static void
+report(FILE *fp, double seconds)
+{
+    double p50 = 0, p90 = 0, p99 = 0, max = 0;
+    bool pass = passed();
+
+    if (answered > 0) {
+        qsort(latencies, answered, sizeof(uint32_t), compare_u32);
+        p50 = latencies[answered * 50 / 100] / 1000.0;
+        p90 = latencies[answered * 90 / 100] / 1000.0;
+        p99 = latencies[answered * 99 / 100] / 1000.0;
+        max = latencies[answered - 1] / 1000.0;
+    }
+
+    fprintf(fp, "duration:        %.1f s\n", seconds);
+    fprintf(fp, "bytes sent:      %llu\n", (unsigned long long) bytes_sent);
+    fprintf(fp, "throughput:      %.0f bytes/s\n", bytes_sent / seconds);
+    fprintf(fp, "probes sent:     %lu\n", (unsigned long) probes);
+    fprintf(fp, "probes answered: %lu\n", (unsigned long) answered);
+    fprintf(fp, "probes lost:     %lu\n", (unsigned long) lost);
+    fprintf(fp, "garbled answers: %lu\n", (unsigned long) garbled);
+    fprintf(fp, "bytes written:   %llu\n", (unsigned long long) bytes_total);
+    if (bytes_received >= 0) {
+        fprintf(fp, "bytes received:  %lld\n", (long long) bytes_received);
+    } else {
+        fprintf(fp, "bytes received:  %s\n",
+                getenv("DMD_SOAK_METRICS") ? "unavailable" : "not checked");
+    }
+    fprintf(fp, "latency p50:     %.2f ms\n", p50);
+    fprintf(fp, "latency p90:     %.2f ms\n", p90);
+    fprintf(fp, "latency p99:     %.2f ms\n", p99);
+    fprintf(fp, "latency max:     %.2f ms\n", max);
+    fprintf(fp, "last line:       %lld\n", (long long) last_line);
+    fprintf(fp, "result:          %s\n", pass ? "pass" : "FAIL");
+}
+
+/*
+ * Check the screen text dumped by the emulator against the lines that
+ * were sent, and add the verdict to the report. From the bottom up,
+ * the non-empty lines must be the last lines sent, in order and
+ * exactly as sent, for at least SCREEN_MIN_LINES lines (or all of
+ * them, for a very short run).
+ */
+static int
+check_screen(const char *screen_path, const char *report_path)
+{
+    char rows[SCREEN_ROWS][LINE_LEN];
+    char expected[LINE_LEN];
+    char buf[LINE_LEN];
+    int count = 0, matched = 0, row;
+    long long last = -1, seq;
+    bool pass;
+    FILE *fp;
+
+    if ((fp = fopen(report_path, "r")) == NULL) {
+        fprintf(stderr, "Cannot read soak report %s\n", report_path);
+        return 1;
+    }
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+        sscanf(buf, "last line: %lld", &last);
+    }
+    fclose(fp);
+
+    if ((fp = fopen(screen_path, "r")) == NULL) {
+        fprintf(stderr, "Cannot read screen text %s\n", screen_path);
+        return 1;
+    }
+    while (count < SCREEN_ROWS && fgets(rows[count], LINE_LEN, fp) != NULL) {
+        rows[count][strcspn(rows[count], "\n")] = '\0';
+        count++;
+    }
+    fclose(fp);
+
+    row = count - 1;
+    while (row >= 0 && rows[row][0] == '\0') {
+        row--;
+    }
+
+    for (seq = last; seq >= 0 && row >= 0; seq--, row--) {
+        format_line(expected, sizeof(expected), (uint32_t) seq);
+        if (strcmp(rows[row], expected) != 0) {
+            break;
+        }
+        matched++;
+    }
+
+    pass = last >= 0 && (matched >= SCREEN_MIN_LINES || matched == last + 1);
+
+    if ((fp = fopen(report_path, "a")) != NULL) {
+        fprintf(fp, "screen lines:    %d\n", matched);
+        fprintf(fp, "screen result:   %s\n", pass ? "pass" : "FAIL");
+        fclose(fp);
+    }
+
+    return pass ? 0 : 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *seconds_env = getenv("DMD_SOAK_SECONDS");
+    const char *report_path = getenv("DMD_SOAK_REPORT");
+    const char *metrics_path = getenv("DMD_SOAK_METRICS");
+    uint64_t duration = (seconds_env ? strtoul(seconds_env, NULL, 10) : 30) * 1000000;
+    uint64_t start, deadline;
+    char line[LINE_LEN];
+    uint32_t seq = 0;
+    FILE *fp;
+
+    if (report_path == NULL) {
+        report_path = "soak-report.txt";
+    }
+
+    if (argc == 3 && strcmp(argv[1], "--check") == 0) {
+        return check_screen(argv[2], report_path);
+    }
+
+    set_raw();
+
+    /* Wait for the firmware to finish booting and answer a first probe */
+    start = now_us();
+    while (answered == 0 && now_us() - start < WARMUP_US) {
+        if (probe_count == 0) {
+            send_probe();
+        }
+        read_responses(1000);
+        expire_probes();
+    }
+
+    answered = probes = lost = garbled = 0;
+    probe_count = 0;
+    bytes_sent = 0;
+
+    start = now_us();
+    deadline = start + duration;
+
+    while (now_us() < deadline) {
+        int len = format_line(line, sizeof(line) - 2, seq);
+
+        memcpy(line + len, "\r\n", 2);
+        if (!write_all(line, len + 2)) {
+            break;
+        }
+        last_line = seq;
+
+        if (++seq % PROBE_INTERVAL == 0) {
+            while (probe_count == MAX_OUTSTANDING) {
+                read_responses(10);
+                expire_probes();
+            }
+            send_probe();
+        }
+
+        read_responses(0);
+        expire_probes();
+    }
+
+    /* A last probe marks the end of the stream, then collect the
+     * answers still in flight */
+    while (probe_count == MAX_OUTSTANDING) {
+        read_responses(10);
+        expire_probes();
+    }
+    send_probe();
+
+    while (probe_count > 0) {
+        read_responses(10);
+        expire_probes();
+    }
+
+    if (metrics_path != NULL) {
+        bytes_received = fetch_received(metrics_path);
+    }
+
+    fp = fopen(report_path, "w");
+    if (fp != NULL) {
+        report(fp, (now_us() - start) / 1e6);
+        fclose(fp);
+    }
+
+    return passed() ? 0 : 1;
+}
@@ -0,0 +1,164 @@
+/*
+ * This file is part of the GTK+ DMD 5620 Emultor.
+ *
+ * Copyright 2018, Seth Morabito <web@loomcom.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Convert a binary trace written by dmd5620 (on SIGUSR1, or at exit
+ * with --trace FILE) into Chrome trace-event JSON, for viewing in
+ * chrome://tracing or Perfetto.
+ *
+ * Usage: dmd_trace2json TRACE [OUTPUT]
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/trace.h"
+
+static const char *
+counter_name(uint16_t type)
+{
+    switch (type) {
+    case TRACE_STEPS:
+        return "steps";
+    case TRACE_RX_BATCH:
+        return "rx bytes";
+    case TRACE_TX_BATCH:
+        return "tx bytes";
+    case TRACE_VRAM_DIRTY:
+        return "dirty rows";
+    case TRACE_BURST:
+        return "burst steps";
+    default:
+        return NULL;
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct trace_file_header header;
+    struct trace_ring_header rh;
+    struct trace_record rec;
+    uint64_t base = UINT64_MAX;
+    long records_at;
+    bool first = true;
+    FILE *in, *out;
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s TRACE [OUTPUT]\n", argv[0]);
+        return 1;
+    }
+
+    in = fopen(argv[1], "rb");
+
+    if (in == NULL) {
+        fprintf(stderr, "Could not open %s.\n", argv[1]);
+        return 1;
+    }
+
+    if (fread(&header, sizeof(header), 1, in) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TRACE_VERSION) {
+        fprintf(stderr, "%s is not a dmd5620 trace.\n", argv[1]);
+        return 1;
+    }
+
+    out = (argc == 3) ? fopen(argv[2], "w") : stdout;
+
+    if (out == NULL) {
+        fprintf(stderr, "Could not open %s for writing.\n", argv[2]);
+        return 1;
+    }
+
+    /* First pass: find the earliest timestamp, so times start at 0 */
+    records_at = ftell(in);
+    for (uint32_t i = 0; i < header.rings; i++) {
+        if (fread(&rh, sizeof(rh), 1, in) != 1) {
+            break;
+        }
+        for (uint32_t j = 0; j < rh.count; j++) {
+            if (fread(&rec, sizeof(rec), 1, in) != 1) {
+                break;
+            }
+            if (rec.time_ns < base) {
+                base = rec.time_ns;
+            }
+        }
+    }
+    fseek(in, records_at, SEEK_SET);
+
+    fprintf(out, "{\"traceEvents\":[\n");
+
+    for (uint32_t i = 0; i < header.rings; i++) {
+        if (fread(&rh, sizeof(rh), 1, in) != 1) {
+            break;
+        }
+
+        for (uint32_t j = 0; j < rh.count; j++) {
+            const char *counter;
+            double ts;
+
+            if (fread(&rec, sizeof(rec), 1, in) != 1) {
+                break;
+            }
+
+            ts = (rec.time_ns - base) / 1000.0;
+            counter = counter_name(rec.type);
+
+            fprintf(out, "%s", first ? "" : ",\n");
+            first = false;
+
+            if (counter != NULL) {
+                fprintf(out, "{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,"
+                        "\"tid\":%u,\"args\":{\"value\":%u}}",
+                        counter, ts, rh.tid, rec.arg);
+            } else if (rec.type == TRACE_TICK_BEGIN || rec.type == TRACE_TICK_END) {
+                fprintf(out, "{\"name\":\"tick\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,"
+                        "\"tid\":%u}",
+                        rec.type == TRACE_TICK_BEGIN ? "B" : "E", ts, rh.tid);
+            } else if (rec.type == TRACE_KEY || rec.type == TRACE_MOUSE) {
+                fprintf(out, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+                        "\"pid\":1,\"tid\":%u,\"args\":{\"value\":%u}}",
+                        rec.type == TRACE_KEY ? "key" : "mouse", ts, rh.tid, rec.arg);
+            } else {
+                fprintf(out, "{\"name\":\"type %u\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+                        "\"pid\":1,\"tid\":%u,\"args\":{\"value\":%u}}",
+                        rec.type, ts, rh.tid, rec.arg);
+            }
+        }
+    }
+
+    fprintf(out, "\n]}\n");
+
+    fclose(in);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return 0;
+}
@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# Training workload for the profile-guided release build. This is run
+# as the terminal's shell by "make release", with the emulator in
+# --headless --fast-boot mode:
+#
+#   ./dmd5620 --headless --fast-boot --shell tools/pgo-workload.sh
+#
+# The firmware boot is covered by the emulator itself. This script
+# then scrolls a screenful of text many times over, and finally
+# streams a large block of hex text at full speed. Everything here is
+# plain text shown by the terminal: there is no host loader, so the
+# layers (xt) protocol and the firmware's download path are not
+# trained.
+#
+
+PATH=/usr/local/bin:/usr/bin:/bin
+export PATH
+
+LINES=${PGO_LINES:-3000}
+DOWNLOAD_BYTES=${PGO_DOWNLOAD_BYTES:-262144}
+
+# Give the firmware time to finish its self-test
+sleep 3
+
+# Scrolling text
+i=0
+while [ $i -lt $LINES ]; do
+    echo "$i: The quick brown fox jumps over the lazy dog. 0123456789 !@#\$%^&*()"
+    i=$((i + 1))
+done
+
+# Bulk serial input: S-record style hex lines (32 bytes each, with an
+# address and checksum), printed to the screen like any other text.
+# The bytes come from a fixed-seed generator, so every training run
+# sends the same stream, and all of it is printable, so the firmware
+# never sees stray control characters.
+awk -v bytes=$DOWNLOAD_BYTES 'BEGIN {
+    x = 5620
+    for (addr = 0; addr < bytes; addr += 32) {
+        a = 4194304 + addr
+        line = sprintf("S3%02X%08X", 37, a)
+        sum = 37 + int(a / 16777216) + int(a / 65536) % 256 + int(a / 256) % 256 + a % 256
+        for (i = 0; i < 32; i++) {
+            x = (x * 69069 + 1) % 4294967296
+            b = int(x / 16777216)
+            line = line sprintf("%02X", b)
+            sum += b
+        }
+        printf "%s%02X\r\n", line, 255 - sum % 256
+    }
+}'
+
+sleep 1
+exit 0